@@ -36,6 +36,59 @@ typedef struct {
 	int microcode_register;
 } em8300_register_t;
 
+typedef struct {
+	int subdevice;	/* EM8300_SUBDEVICE_VIDEO or EM8300_SUBDEVICE_SUBPICTURE */
+	int nslots;	/* 0 means as many slots as the microcode provides */
+	int slotsize;	/* in bytes, 0 means unchanged */
+	int threshold;	/* free slots to wake up writers, 0 means nslots / 2,
+			   -1 adapts it to the rate the card reads at */
+} em8300_fifo_geometry_t;
+
+typedef struct {
+	unsigned length;	/* in: bytes written at head, a multiple of 4 as
+				   the card reads from 4 byte aligned addresses;
+				   out: bytes queued */
+	int flags;		/* EM8300_VIDEO_COMMIT_* */
+	unsigned pts;		/* used with EM8300_VIDEO_COMMIT_PTS */
+	unsigned head;		/* out: where to write the next data */
+	unsigned tail;		/* out: the free space ends here */
+	unsigned size;		/* out: size of the mapped ring */
+} em8300_video_commit_t;
+
+typedef struct {
+	const void *data;
+	unsigned size;
+	unsigned pts;		/* used with EM8300_VIDEO_PACKET_PTS */
+	int flags;		/* EM8300_VIDEO_PACKET_* */
+} em8300_video_packet_t;
+
+typedef struct {
+	em8300_video_packet_t *packets;
+	unsigned count;		/* in: packets, out: packets fully written */
+	unsigned written;	/* out: bytes written */
+} em8300_video_writev_t;
+
+typedef struct {
+	unsigned pts;		/* first PTS of the next clip, in its own time base */
+	unsigned position;	/* where that PTS goes on the timeline */
+	int flags;		/* EM8300_VIDEO_SEGMENT_* */
+	unsigned duration;	/* frame duration in 90kHz ticks, for EM8300_VIDEO_SEGMENT_FOLLOW */
+} em8300_video_segment_t;
+
+typedef struct {
+	int enable;		/* slave the SCR to the audio clock */
+	unsigned pts;		/* 90kHz PTS of the audio frame at frame */
+	unsigned frame;		/* position in the ALSA playback stream */
+} em8300_avsync_t;
+
+/* Payload of an EM8300_EVENT_VBL event, in v4l2_event.u.data */
+typedef struct {
+	unsigned long long timestamp;	/* CLOCK_MONOTONIC, in ns, at the interrupt */
+	unsigned framecount;	/* frames decoded, as in MV_FrameCntLo/Hi */
+	unsigned scr;		/* as returned by EM8300_IOCTL_SCR_GET */
+	unsigned vblcount;	/* VBL interrupts since the card was set up */
+} em8300_vbl_event_t;
+
 typedef struct {
 	int color;
 	int contrast;
@@ -63,14 +116,38 @@ typedef struct {
 #define EM8300_IOCTL_SCR_SETSPEED _IOW('C',17,unsigned)
 #define EM8300_IOCTL_FLUSH _IOW('C',18,int)
 #define EM8300_IOCTL_VBI _IOW('C',19,struct timeval)
+#define EM8300_IOCTL_GET_FIFO_GEOMETRY _IOWR('C',20,em8300_fifo_geometry_t)
+#define EM8300_IOCTL_SET_FIFO_GEOMETRY _IOW('C',21,em8300_fifo_geometry_t)
+#define EM8300_IOCTL_AVSYNC _IOW('C',22,em8300_avsync_t)
+/* Drop all queued video and sub-picture data, returns the time taken in us */
+#define EM8300_IOCTL_DISCONTINUITY _IOR('C',23,unsigned)
+
+/* V4L2 event sent on every VBL interrupt to subscribers of the video device */
+#define EM8300_EVENT_VBL (V4L2_EVENT_PRIVATE_START + 1)
 
 #define EM8300_OVERLAY_SIGNAL_ONLY 1
 #define EM8300_OVERLAY_SIGNAL_WITH_VGA 2
 #define EM8300_OVERLAY_VGA_ONLY 3
 
+/*
+ * Handled on the same device as the control ioctls above, so no command
+ * may equal one of them
+ */
 #define EM8300_IOCTL_VIDEO_SETPTS _IOW('C',1,int)
 #define EM8300_IOCTL_VIDEO_GETSCR _IOR('C',2,unsigned)
 #define EM8300_IOCTL_VIDEO_SETSCR _IOW('C',2,unsigned)
+#define EM8300_IOCTL_VIDEO_COMMIT _IOWR('C',3,em8300_video_commit_t)
+
+#define EM8300_IOCTL_VIDEO_WRITEV _IOWR('C',4,em8300_video_writev_t)
+/* Start draining the decoder, returns 1 once an earlier drain has completed */
+#define EM8300_IOCTL_VIDEO_DRAIN _IOR('C',8,int)
+/* PTS and SCR given from now on belong to the next clip */
+#define EM8300_IOCTL_VIDEO_SEGMENT _IOW('C',6,em8300_video_segment_t)
+
+#define EM8300_VIDEO_COMMIT_PTS 1
+#define EM8300_VIDEO_PACKET_PTS 1
+#define EM8300_VIDEO_WRITEV_MAX 64
+#define EM8300_VIDEO_SEGMENT_FOLLOW 1	/* start duration after the last PTS, ignore position */
 
 #define EM8300_IOCTL_SPU_SETPTS _IOW('C',1,int)
 #define EM8300_IOCTL_SPU_SETPALETTE _IOW('C',2,unsigned[16])
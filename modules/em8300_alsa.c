@@ -19,47 +19,98 @@
  */
 
 #include <linux/export.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/control.h>
 #include <sound/initval.h>
+#include <sound/asoundef.h>
 #include <linux/em8300.h>
 #include <linux/pci.h>
 
 #include "em8300_reg.h"
 #include "em8300_driver.h"
-
-typedef struct snd_em8300_pcm_indirect {
-	unsigned int hw_buffer_size;    /* Byte size of hardware buffer */
-	unsigned int hw_queue_size;     /* Max queue size of hw buffer (0 = buffer size) */
-	unsigned int hw_data;   /* Offset to next dst (or src) in hw ring buffer */
-	unsigned int hw_io;     /* Ring buffer hw pointer */
-	int hw_ready;           /* Bytes ready for play (or captured) in hw ring buffer */
-	unsigned int sw_buffer_size;    /* Byte size of software buffer */
-	unsigned int sw_data;   /* Offset to next dst (or src) in sw ring buffer */
-	unsigned int sw_io;     /* Current software pointer in bytes */
-	int sw_ready;           /* Bytes ready to be transferred to/from hw */
-	snd_pcm_uframes_t appl_ptr;     /* Last seen appl_ptr */
-} snd_em8300_pcm_indirect_t;
-
-typedef void (*snd_em8300_pcm_indirect_copy_t)(struct snd_pcm_substream *substream,
-					       snd_em8300_pcm_indirect_t *rec, size_t bytes);
-
+#include "em8300_params.h"
+
+/* Descriptors queued at most */
+#define EM8300_ALSA_DESCRIPTORS 32
+
+/*
+ * Playback is plain cyclic DMA: from the audio fifo interrupt, the ALSA
+ * buffer is handed to the card as MA_PCIStart descriptors, period after
+ * period, and the position is advanced from MA_Rdptr. The pointer callback
+ * only returns what the interrupt found. The card is kept at most two
+ * periods ahead, and MA_Threshold makes it interrupt once it holds less
+ * than one, so that latency and interrupt rate both follow the period.
+ *
+ * The pointer is where the card fetched the ALSA buffer up to; what it
+ * fetched but did not play yet is in its internal buffer and is reported
+ * as runtime->delay. The state is also sampled at each VBL, and the wall
+ * clock extrapolates the played frames from the last sample.
+ *
+ * The IEC61937 device takes 16 bit stereo, as IEC 61937 bursts are usually
+ * produced, and packs it into IEC958 subframes in a bounce buffer, which
+ * the card is given instead. All positions are then in bytes of the ALSA
+ * buffer, the card counting twice as many.
+ */
 typedef struct {
 	struct em8300_s *em;
 	struct snd_card *card;
 	struct snd_pcm_substream *substream;
-	snd_em8300_pcm_indirect_t indirect;
+
+	spinlock_t lock;
+	unsigned int hw_buffer_size;	/* size of the internal buffer of the card */
+	unsigned int prefetch;		/* bytes to keep queued to the card */
+	unsigned int rdptr;		/* MA_Rdptr at the last update */
+	unsigned int queued;		/* bytes given to the card, not played yet */
+	unsigned int pending;		/* part of queued not fetched yet */
+	unsigned int next;		/* offset of the next period to queue */
+	unsigned int hw_ptr;		/* offset of the next byte to fetch */
+	unsigned int period_pos;	/* bytes fetched in the current period */
+	u64 played;			/* bytes played since the start */
+	ktime_t tstamp;			/* when played was last updated */
+
+	/* Sizes of the descriptors not fetched yet, oldest first */
+	unsigned int desc_size[EM8300_ALSA_DESCRIPTORS];
+	int desc_first;
+	int desc_count;
+	int desc_readindex;		/* MA_PCIRdPtr index at the last update */
+
+	/* IEC61937 device */
+	struct snd_dma_buffer bounce;	/* subframes given to the card */
+	int shift;			/* log2 of card bytes per ALSA byte */
+	unsigned char iec958_status[24];	/* channel status block */
+	unsigned int iec958_pos;	/* frame in the channel status block */
+
+	/* Rates offered by this card, from snd_em8300_rates */
+	unsigned int rates[4];
+	struct snd_pcm_hw_constraint_list rate_constraint;
 } em8300_alsa_t;
 
 #define chip_t em8300_alsa_t
 
 #define EM8300_ALSA_ANALOG_DEVICENUM 0
 #define EM8300_ALSA_DIGITAL_DEVICENUM 1
+#define EM8300_ALSA_IEC61937_DEVICENUM 2
 
 #define EM8300_BLOCK_SIZE 4096
+#define EM8300_MAX_DESCRIPTOR_SIZE 8192
+#define EM8300_MIN_PERIOD_SIZE 256
+#define EM8300_MAX_PERIOD_SIZE (64*1024)
 #define EM8300_MID_BUFFER_SIZE (1024*1024)
 
+/* The rates the clock generator can produce */
+static const struct {
+	unsigned int rate;
+	int clockgen;
+} snd_em8300_rates[] = {
+	{ 32000, CLOCKGEN_SAMPFREQ_32 },
+	{ 44100, CLOCKGEN_SAMPFREQ_44 },
+	{ 48000, CLOCKGEN_SAMPFREQ_48 },
+	{ 66000, CLOCKGEN_SAMPFREQ_66 },	/* only with audio_rate_66 */
+};
+
 static int mpegaudio_command(struct em8300_s *em, int cmd)
 {
 	em8300_waitfor(em, ucregister(MA_Command), 0xffff, 0xffff);
@@ -75,7 +126,8 @@ static struct snd_pcm_hardware snd_em8300_playback_hw = {
 		 SNDRV_PCM_INFO_INTERLEAVED |
 //		 SNDRV_PCM_INFO_BLOCK_TRANSFER |
 		 SNDRV_PCM_INFO_MMAP_VALID |
-		 SNDRV_PCM_INFO_PAUSE,
+		 SNDRV_PCM_INFO_PAUSE |
+		 SNDRV_PCM_INFO_HAS_WALL_CLOCK,
 
 	.rates = SNDRV_PCM_RATE_32000 | SNDRV_PCM_RATE_44100 | SNDRV_PCM_RATE_48000,
 
@@ -84,10 +136,10 @@ static struct snd_pcm_hardware snd_em8300_playback_hw = {
 	.channels_min = 2,
 	.channels_max = 2,
 	.buffer_bytes_max = EM8300_MID_BUFFER_SIZE,
-	.period_bytes_min = EM8300_BLOCK_SIZE,
-	.period_bytes_max = EM8300_BLOCK_SIZE,
+	.period_bytes_min = EM8300_MIN_PERIOD_SIZE,
+	.period_bytes_max = EM8300_MAX_PERIOD_SIZE,
 	.periods_min = 2,
-	.periods_max = EM8300_MID_BUFFER_SIZE / EM8300_BLOCK_SIZE,
+	.periods_max = EM8300_MID_BUFFER_SIZE / EM8300_MIN_PERIOD_SIZE,
 };
 
 static int snd_em8300_playback_open(struct snd_pcm_substream *substream)
@@ -96,11 +148,39 @@ static int snd_em8300_playback_open(struct snd_pcm_substream *substream)
 	struct em8300_s *em = em8300_alsa->em;
 	struct snd_pcm_runtime *runtime = substream->runtime;
 
+	/*
+	 * The devices share the card, and the state of the substream (bounce
+	 * buffer, rate, positions): only one of them can be open at a time.
+	 * The substream is stored for the interrupt handler, which only
+	 * looks at it once it is running.
+	 */
+	spin_lock_irq(&em8300_alsa->lock);
+	if (em8300_alsa->substream) {
+		spin_unlock_irq(&em8300_alsa->lock);
+		return -EBUSY;
+	}
+	em8300_alsa->substream = substream;
+	spin_unlock_irq(&em8300_alsa->lock);
+
 	if (substream->pcm->device == EM8300_ALSA_ANALOG_DEVICENUM)
 		snd_em8300_playback_hw.formats = SNDRV_PCM_FMTBIT_S16_BE;
-	else
+	else if (substream->pcm->device == EM8300_ALSA_DIGITAL_DEVICENUM)
 		snd_em8300_playback_hw.formats = SNDRV_PCM_FMTBIT_IEC958_SUBFRAME_BE;
+	else
+		snd_em8300_playback_hw.formats = SNDRV_PCM_FMTBIT_S16_LE;
 	runtime->hw = snd_em8300_playback_hw;
+	/* The bounce buffer is twice as large, and filled by snd_em8300_pcm_copy */
+	if (substream->pcm->device == EM8300_ALSA_IEC61937_DEVICENUM) {
+		runtime->hw.buffer_bytes_max /= 2;
+		runtime->hw.info &= ~(SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID);
+	}
+	/* The buffer is walked one period after the other */
+	snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+	/* Refuse what the clock generator cannot do */
+	runtime->hw.rates |= SNDRV_PCM_RATE_KNOT;
+	runtime->hw.rate_max = em8300_alsa->rates[em8300_alsa->rate_constraint.count - 1];
+	snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_RATE,
+				   &em8300_alsa->rate_constraint);
 
 //	printk("em8300-%d: snd_em8300_playback_open called.\n", em->instance);
 
@@ -117,10 +197,6 @@ static int snd_em8300_playback_open(struct snd_pcm_substream *substream)
 	} else {
 		write_register(AUDIO_RATE, 0x3a0);
 	}
-	write_ucregister(MA_Threshold, 6);
-
-	/* store current used substream - needed for interrupt handler */
-	em8300_alsa->substream = substream;
 
 	return 0;
 }
@@ -128,57 +204,146 @@ static int snd_em8300_playback_open(struct snd_pcm_substream *substream)
 static int snd_em8300_playback_close(struct snd_pcm_substream *substream)
 {
 	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
+
+	spin_lock_irq(&em8300_alsa->lock);
 	em8300_alsa->substream = NULL;
+	spin_unlock_irq(&em8300_alsa->lock);
 	/* TODO: check if we need to free any private data */
 
 	return 0;
 }
 
+static void snd_em8300_pcm_free_bounce(em8300_alsa_t *em8300_alsa)
+{
+	if (em8300_alsa->bounce.area)
+		snd_dma_free_pages(&em8300_alsa->bounce);
+	memset(&em8300_alsa->bounce, 0, sizeof(em8300_alsa->bounce));
+	em8300_alsa->shift = 0;
+}
+
 static int snd_em8300_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *hw_params)
 {
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
+	struct em8300_s *em = em8300_alsa->em;
+	int ret;
 //	printk("em8300-%d: snd_em8300_pcm_hw_params called.\n", em->instance);
+
+	snd_em8300_pcm_free_bounce(em8300_alsa);
+	if (substream->pcm->device == EM8300_ALSA_IEC61937_DEVICENUM) {
+		ret = snd_dma_alloc_pages(SNDRV_DMA_TYPE_DEV, snd_dma_pci_data(em->pci_dev),
+					  2 * params_buffer_bytes(hw_params),
+					  &em8300_alsa->bounce);
+		if (ret < 0)
+			return ret;
+		em8300_alsa->shift = 1;
+	}
+
 	return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(hw_params));
 }
 
 static int snd_em8300_pcm_hw_free(struct snd_pcm_substream *substream)
 {
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
 //	printk("em8300-%d: snd_em8300_pcm_hw_free called.\n", em->instance);
+
+	snd_em8300_pcm_free_bounce(em8300_alsa);
 	return snd_pcm_lib_free_pages(substream);
 }
 
-static int snd_em8300_pcm_prepare(struct snd_pcm_substream *substream)
+/* Consumer channel status of the IEC61937 device: non-audio, at rate */
+static void snd_em8300_pcm_iec958_status(em8300_alsa_t *em8300_alsa, unsigned int rate)
 {
-	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
-	struct em8300_s *em = em8300_alsa->em;
-	struct snd_pcm_runtime *runtime = substream->runtime;
-//	printk("em8300-%d: snd_em8300_pcm_prepare called.\n", em->instance);
+	unsigned char *status = em8300_alsa->iec958_status;
 
-	em->clockgen &= ~CLOCKGEN_SAMPFREQ_MASK;
-	switch (runtime->rate) {
-	case 48000:
-//		printk("em8300-%d: runtime->rate set to 48000\n", em->instance);
-		em->clockgen |= CLOCKGEN_SAMPFREQ_48;
-		break;
+	memset(em8300_alsa->iec958_status, 0, sizeof(em8300_alsa->iec958_status));
+	status[0] = IEC958_AES0_NONAUDIO | IEC958_AES0_CON_NOT_COPYRIGHT;
+	status[1] = IEC958_AES1_CON_ORIGINAL | IEC958_AES1_CON_PCM_CODER;
+	switch (rate) {
 	case 44100:
-//		printk("em8300-%d: runtime->rate set to 44100\n", em->instance);
-		em->clockgen |= CLOCKGEN_SAMPFREQ_44;
+		status[3] = IEC958_AES3_CON_FS_44100;
 		break;
 	case 32000:
-//		printk("em8300-%d: runtime->rate set to 32000\n", em->instance);
-		em->clockgen |= CLOCKGEN_SAMPFREQ_32;
+		status[3] = IEC958_AES3_CON_FS_32000;
+		break;
+	case 66000:
+		status[3] = IEC958_AES3_CON_FS_NOTID;
 		break;
 	default:
-//		printk("em8300-%d: bad runtime->rate\n", em->instance);
-		em->clockgen |= CLOCKGEN_SAMPFREQ_48;
+		status[3] = IEC958_AES3_CON_FS_48000;
+	}
+}
+
+/*
+ * Pack 16 bit stereo frames into IEC958 subframes, as the digital device
+ * takes them: sample in bits 12-27, channel status in bit 30, even parity
+ * of bits 4-30 in bit 31, and the preamble in bits 0-3, coded as in
+ * EM8300.conf.
+ */
+static void snd_em8300_pcm_pack(em8300_alsa_t *em8300_alsa, u32 *dst,
+				const u16 *src, unsigned int frames)
+{
+	unsigned int pos = em8300_alsa->iec958_pos;
+	u32 left, right, c;
+
+	while (frames--) {
+		c = (em8300_alsa->iec958_status[pos >> 3] >> (pos & 7)) & 1 ? 0x40000000 : 0;
+		left = ((u32)le16_to_cpu(src[0]) << 12) | c;
+		right = ((u32)le16_to_cpu(src[1]) << 12) | c;
+		if (hweight32(left) & 1)
+			left |= 0x80000000;
+		if (hweight32(right) & 1)
+			right |= 0x80000000;
+		dst[0] = cpu_to_be32(left | (pos ? 0x02 : 0x00));	/* X or Z */
+		dst[1] = cpu_to_be32(right | 0x01);			/* Y */
+		src += 2;
+		dst += 2;
+		if (++pos == 192)
+			pos = 0;
 	}
+	em8300_alsa->iec958_pos = pos;
+}
+
+static int snd_em8300_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
+	struct em8300_s *em = em8300_alsa->em;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	unsigned int period_bytes, chunk;
+	int i;
+//	printk("em8300-%d: snd_em8300_pcm_prepare called.\n", em->instance);
+
+	for (i = 0; i < ARRAY_SIZE(snd_em8300_rates); i++)
+		if (snd_em8300_rates[i].rate == runtime->rate)
+			break;
+	if (i == ARRAY_SIZE(snd_em8300_rates)) {
+		printk(KERN_ERR "em8300-%d: unsupported audio rate %u\n", em->instance, runtime->rate);
+		return -EINVAL;
+	}
+	em->clockgen &= ~CLOCKGEN_SAMPFREQ_MASK;
+	em->clockgen |= snd_em8300_rates[i].clockgen;
 	em8300_clockgen_write(em, em->clockgen);
 
-	memset(&em8300_alsa->indirect, 0, sizeof(em8300_alsa->indirect));
-	em8300_alsa->indirect.hw_buffer_size =
+	em8300_alsa->hw_buffer_size =
 		(read_ucregister(MA_BuffSize_Hi) << 16)
 		| read_ucregister(MA_BuffSize);
-	em8300_alsa->indirect.sw_buffer_size =
-		snd_pcm_lib_buffer_bytes(substream);
+
+	if (em8300_alsa->shift) {
+		snd_em8300_pcm_iec958_status(em8300_alsa, runtime->rate);
+		/* The frames are packed as they are written, from now on */
+		em8300_alsa->iec958_pos = 0;
+	}
+
+	period_bytes = snd_pcm_lib_period_bytes(substream);
+	chunk = min_t(unsigned int, period_bytes << em8300_alsa->shift,
+		      EM8300_MAX_DESCRIPTOR_SIZE);
+	em8300_alsa->prefetch = min_t(unsigned int, 2 * period_bytes,
+				      (em8300_alsa->hw_buffer_size - EM8300_BLOCK_SIZE)
+				      >> em8300_alsa->shift) & ~7;
+	/* Interrupt when less than half the prefetch (one period) is queued */
+	write_ucregister(MA_Threshold,
+			 max_t(unsigned int,
+			       DIV_ROUND_UP((em8300_alsa->prefetch << em8300_alsa->shift) / 2, chunk),
+			       1));
 
 	write_ucregister(MA_PCIRdPtr, ucregister(MA_PCIStart) - 0x1000);
 	write_ucregister(MA_PCIWrPtr, ucregister(MA_PCIStart) - 0x1000);
@@ -186,7 +351,8 @@ static int snd_em8300_pcm_prepare(struct snd_pcm_substream *substream)
 	return 0;
 }
 
-static int snd_em8300_pcm_ack(struct snd_pcm_substream *substream);
+static void snd_em8300_pcm_refill(em8300_alsa_t *em8300_alsa);
+static void snd_em8300_pcm_sample(em8300_alsa_t *em8300_alsa, ktime_t now);
 
 static int snd_em8300_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
@@ -196,11 +362,23 @@ static int snd_em8300_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 //	printk("em8300-%d: snd_em8300_pcm_trigger(%d) called.\n", em->instance, cmd);
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		em8300_alsa->indirect.hw_io =
-		em8300_alsa->indirect.hw_data =
+		spin_lock(&em8300_alsa->lock);
+		em8300_alsa->rdptr =
 			((read_ucregister(MA_Rdptr_Hi) << 16)
 			| read_ucregister(MA_Rdptr)) & ~3;
-		snd_em8300_pcm_ack(substream);
+		em8300_alsa->desc_readindex =
+			(read_ucregister(MA_PCIRdPtr) - (ucregister(MA_PCIStart) - 0x1000)) / 3;
+		em8300_alsa->desc_first = 0;
+		em8300_alsa->desc_count = 0;
+		em8300_alsa->queued = 0;
+		em8300_alsa->pending = 0;
+		em8300_alsa->next = 0;
+		em8300_alsa->hw_ptr = 0;
+		em8300_alsa->period_pos = 0;
+		em8300_alsa->played = 0;
+		em8300_alsa->tstamp = ktime_get();
+		snd_em8300_pcm_refill(em8300_alsa);
+		spin_unlock(&em8300_alsa->lock);
 		em->irqmask |= IRQSTATUS_AUDIO_FIFO;
 		write_ucregister(Q_IrqMask, em->irqmask);
 		mpegaudio_command(em, MACOMMAND_PLAY);
@@ -214,6 +392,13 @@ static int snd_em8300_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 		mpegaudio_command(em, MACOMMAND_PAUSE);
 		break;
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		/*
+		 * The wall clock extrapolates from the last sample, which is
+		 * from before the pause: take a new one as playback resumes.
+		 */
+		spin_lock(&em8300_alsa->lock);
+		snd_em8300_pcm_sample(em8300_alsa, ktime_get());
+		spin_unlock(&em8300_alsa->lock);
 		mpegaudio_command(em, MACOMMAND_PLAY);
 		break;
 	default:
@@ -223,114 +408,251 @@ static int snd_em8300_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 }
 
 
-static inline snd_pcm_uframes_t
-snd_em8300_pcm_indirect_playback_pointer(struct snd_pcm_substream *substream,
-					 snd_em8300_pcm_indirect_t *rec, unsigned int ptr)
+static snd_pcm_uframes_t snd_em8300_pcm_pointer(struct snd_pcm_substream *substream)
 {
-	int bytes = ptr - rec->hw_io;
-	if (bytes < 0)
-		bytes += rec->hw_buffer_size;
-	rec->hw_io = ptr;
-	rec->hw_ready -= bytes;
-	rec->sw_io += bytes;
-	if (rec->sw_io >= rec->sw_buffer_size)
-		rec->sw_io -= rec->sw_buffer_size;
-	if (substream->ops->ack)
-		substream->ops->ack(substream);
-	return bytes_to_frames(substream->runtime, rec->sw_io);
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	runtime->delay = bytes_to_frames(runtime, em8300_alsa->queued - em8300_alsa->pending);
+	return bytes_to_frames(runtime, em8300_alsa->hw_ptr);
 }
 
-static snd_pcm_uframes_t snd_em8300_pcm_pointer(struct snd_pcm_substream *substream)
+/* Bytes the card played since the last update */
+static unsigned int snd_em8300_pcm_played(em8300_alsa_t *em8300_alsa)
 {
-//	snd_pcm_runtime_t *runtime = substream->runtime;
-	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
 	struct em8300_s *em = em8300_alsa->em;
-	unsigned int hw_ptr =
+	struct snd_pcm_runtime *runtime = em8300_alsa->substream->runtime;
+	unsigned int rdptr =
 		((read_ucregister(MA_Rdptr_Hi) << 16)
 		 | read_ucregister(MA_Rdptr)) & ~3;
-//	snd_pcm_uframes_t ret = snd_pcm_indirect_playback_pointer(substream,
-//								  &em8300_alsa->indirect,
-//								  hw_ptr);
-//	printk("em8300-%d: snd_em8300_pcm_pointer called: %d\n", em->instance, ret);
-//	return ret;
-	return snd_em8300_pcm_indirect_playback_pointer(substream,
-							&em8300_alsa->indirect,
-							hw_ptr);
+	int bytes = rdptr - em8300_alsa->rdptr;
+
+	if (bytes < 0)
+		bytes += em8300_alsa->hw_buffer_size;
+	/*
+	 * In whole frames: with IEC958 subframes the card may stop between
+	 * the two of a frame. It does not play what it did not fetch.
+	 */
+	return min_t(unsigned int,
+		     (bytes >> em8300_alsa->shift) & ~(frames_to_bytes(runtime, 1) - 1),
+		     em8300_alsa->queued - em8300_alsa->pending);
 }
 
-static void snd_em8300_pcm_trans_dma(struct snd_pcm_substream *substream,
-				     snd_em8300_pcm_indirect_t *rec,
-				     size_t bytes)
+/* Bytes the card fetched since the last update */
+static unsigned int snd_em8300_pcm_fetched(em8300_alsa_t *em8300_alsa)
 {
-//	snd_pcm_runtime_t *runtime = substream->runtime;
-	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
 	struct em8300_s *em = em8300_alsa->em;
-	int writeindex = ((int)read_ucregister(MA_PCIWrPtr) - (ucregister(MA_PCIStart) - 0x1000)) / 3;
-	int readindex = ((int)read_ucregister(MA_PCIRdPtr) - (ucregister(MA_PCIStart) - 0x1000)) / 3;
-	writel((unsigned long int)(substream->runtime->dma_addr + rec->sw_data) >> 16,
-	       ((uint32_t *)ucregister_ptr(MA_PCIStart))+3*writeindex);
-	writel((unsigned long int)(substream->runtime->dma_addr + rec->sw_data) & 0xffff,
-	       ((uint32_t *)ucregister_ptr(MA_PCIStart))+3*writeindex+1);
-	writel(bytes,
-	       ((uint32_t *)ucregister_ptr(MA_PCIStart))+3*writeindex+2);
-	writeindex += 1;
-	writeindex %= read_ucregister(MA_PCISize) / 3;
-//	printk("em8300-%d: snd_em8300_pcm_trans_dma(%d) called.\n", em->instance, bytes);
-	if (readindex != writeindex)
-		write_ucregister(MA_PCIWrPtr, ucregister(MA_PCIStart) - 0x1000 + writeindex * 3);
-	else
-		printk("em8300-%d: snd_em8300_pcm_trans_dma failed.\n", em->instance);
+	int base = ucregister(MA_PCIStart) - 0x1000;
+	int nentries = read_ucregister(MA_PCISize) / 3;
+	int readindex = ((int)read_ucregister(MA_PCIRdPtr) - base) / 3;
+	int n = (readindex - em8300_alsa->desc_readindex + nentries) % nentries;
+	unsigned int bytes = 0;
+
+	em8300_alsa->desc_readindex = readindex;
+	while (n-- > 0 && em8300_alsa->desc_count) {
+		bytes += em8300_alsa->desc_size[em8300_alsa->desc_first];
+		em8300_alsa->desc_first = (em8300_alsa->desc_first + 1) % EM8300_ALSA_DESCRIPTORS;
+		em8300_alsa->desc_count--;
+	}
+	return bytes;
 }
 
-static inline void
-snd_em8300_pcm_indirect_playback_transfer(struct snd_pcm_substream *substream,
-					  snd_em8300_pcm_indirect_t *rec,
-					  snd_em8300_pcm_indirect_copy_t copy)
+/*
+ * Advance the played position to what the card played as of now, the
+ * baseline snd_em8300_pcm_wall_clock extrapolates from. Must be called with
+ * the lock held.
+ */
+static void snd_em8300_pcm_sample(em8300_alsa_t *em8300_alsa, ktime_t now)
+{
+	unsigned int bytes = snd_em8300_pcm_played(em8300_alsa);
+
+	em8300_alsa->rdptr += bytes << em8300_alsa->shift;
+	if (em8300_alsa->rdptr >= em8300_alsa->hw_buffer_size)
+		em8300_alsa->rdptr -= em8300_alsa->hw_buffer_size;
+	em8300_alsa->queued -= bytes;
+	em8300_alsa->played += bytes;
+	em8300_alsa->tstamp = now;
+}
+
+/*
+ * Advance the positions to what the card fetched and played, as of now.
+ * Returns 1 if a period was completed. Must be called with the lock held.
+ */
+static int snd_em8300_pcm_update(em8300_alsa_t *em8300_alsa, ktime_t now)
+{
+	struct snd_pcm_runtime *runtime = em8300_alsa->substream->runtime;
+	unsigned int period_bytes = snd_pcm_lib_period_bytes(em8300_alsa->substream);
+	unsigned int bytes;
+
+	bytes = snd_em8300_pcm_fetched(em8300_alsa);
+	em8300_alsa->pending -= bytes;
+	em8300_alsa->hw_ptr += bytes;
+	if (em8300_alsa->hw_ptr >= frames_to_bytes(runtime, runtime->buffer_size))
+		em8300_alsa->hw_ptr -= frames_to_bytes(runtime, runtime->buffer_size);
+	em8300_alsa->period_pos += bytes;
+
+	snd_em8300_pcm_sample(em8300_alsa, now);
+
+	if (em8300_alsa->period_pos < period_bytes)
+		return 0;
+	em8300_alsa->period_pos %= period_bytes;
+	return 1;
+}
+
+/*
+ * Frames played as of now: those played at the last update, plus what the
+ * card went on playing since, as far as it had fetched.
+ */
+static int snd_em8300_pcm_wall_clock(struct snd_pcm_substream *substream,
+				     struct timespec *audio_ts)
 {
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;
-	snd_pcm_uframes_t appl_ptr = runtime->control->appl_ptr;
-	snd_pcm_sframes_t diff = appl_ptr - rec->appl_ptr;
-	int qsize;
-
-	if (diff) {
-		if (diff < -(snd_pcm_sframes_t) (runtime->boundary / 2))
-			diff += runtime->boundary;
-		rec->sw_ready += (int)frames_to_bytes(runtime, diff);
-		rec->appl_ptr = appl_ptr;
+	unsigned long flags;
+	u64 frames, ahead;
+	s64 ns;
+
+	if (!runtime->rate)
+		return -EINVAL;
+
+	spin_lock_irqsave(&em8300_alsa->lock, flags);
+	frames = div_u64(em8300_alsa->played, frames_to_bytes(runtime, 1));
+	ahead = bytes_to_frames(runtime, em8300_alsa->queued - em8300_alsa->pending);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), em8300_alsa->tstamp));
+	spin_unlock_irqrestore(&em8300_alsa->lock, flags);
+
+	if (runtime->status->state == SNDRV_PCM_STATE_RUNNING && ns > 0)
+		frames += min_t(u64, div_u64((u64)ns * runtime->rate, NSEC_PER_SEC), ahead);
+
+	*audio_ts = ns_to_timespec(div_u64(frames * NSEC_PER_SEC, runtime->rate));
+	return 0;
+}
+
+/*
+ * Fill descriptor writeindex with the next piece of the ALSA buffer: the
+ * rest of the current period, up to a descriptor and no more than room.
+ * Returns the number of bytes queued, 0 if not a whole frame fits; the
+ * caller moves MA_PCIWrPtr.
+ */
+static unsigned int snd_em8300_pcm_queue(em8300_alsa_t *em8300_alsa, unsigned int room,
+					 int writeindex)
+{
+	struct em8300_s *em = em8300_alsa->em;
+	struct snd_pcm_substream *substream = em8300_alsa->substream;
+	unsigned int period_bytes = snd_pcm_lib_period_bytes(substream);
+	unsigned int size = period_bytes - em8300_alsa->next % period_bytes;
+	unsigned long addr;
+	uint32_t *desc;
+
+	size = min3(size, room, (unsigned int)EM8300_MAX_DESCRIPTOR_SIZE >> em8300_alsa->shift);
+	/* The packing and the positions work on whole frames */
+	size &= ~(frames_to_bytes(substream->runtime, 1) - 1);
+	if (!size)
+		return 0;
+	/* IEC61937 frames were packed into the bounce buffer by snd_em8300_pcm_copy */
+	if (em8300_alsa->shift) {
+		addr = em8300_alsa->bounce.addr + (em8300_alsa->next << 1);
+	} else {
+		addr = substream->runtime->dma_addr + em8300_alsa->next;
 	}
-	qsize = rec->hw_queue_size ? rec->hw_queue_size : rec->hw_buffer_size;
-	while (rec->hw_ready < qsize - 4096 && rec->sw_ready > 0) {
-		unsigned int sw_to_end = rec->sw_buffer_size - rec->sw_data;
-		unsigned int bytes = qsize - rec->hw_ready;
-		if (rec->sw_ready < (int)bytes)
-			bytes = rec->sw_ready;
-		if (sw_to_end < bytes)
-			bytes = sw_to_end;
-		if (8192 < bytes)
-			bytes = 8192;
-		if (!bytes)
+
+	desc = ((uint32_t *)ucregister_ptr(MA_PCIStart)) + 3 * writeindex;
+	writel(addr >> 16, desc);
+	writel(addr & 0xffff, desc + 1);
+	writel(size << em8300_alsa->shift, desc + 2);
+
+	em8300_alsa->desc_size[(em8300_alsa->desc_first + em8300_alsa->desc_count)
+			       % EM8300_ALSA_DESCRIPTORS] = size;
+	em8300_alsa->desc_count++;
+
+	return size;
+}
+
+/*
+ * Keep the card prefetch bytes ahead. The descriptor ring registers are
+ * read once, and the write pointer moved once. Must be called with the
+ * lock held.
+ */
+static void snd_em8300_pcm_refill(em8300_alsa_t *em8300_alsa)
+{
+	struct em8300_s *em = em8300_alsa->em;
+	struct snd_pcm_runtime *runtime = em8300_alsa->substream->runtime;
+	unsigned int buffer_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+	int base = ucregister(MA_PCIStart) - 0x1000;
+	int nentries = read_ucregister(MA_PCISize) / 3;
+	int readindex = ((int)read_ucregister(MA_PCIRdPtr) - base) / 3;
+	int writeindex = ((int)read_ucregister(MA_PCIWrPtr) - base) / 3;
+	int start = writeindex;
+	unsigned int size;
+
+	while (em8300_alsa->queued < em8300_alsa->prefetch &&
+	       (writeindex + 1) % nentries != readindex &&
+	       em8300_alsa->desc_count < EM8300_ALSA_DESCRIPTORS) {
+		size = snd_em8300_pcm_queue(em8300_alsa,
+					    em8300_alsa->prefetch - em8300_alsa->queued, writeindex);
+		if (!size)
 			break;
-		copy(substream, rec, bytes);
-		rec->hw_data += bytes;
-		if (rec->hw_data == rec->hw_buffer_size)
-			rec->hw_data = 0;
-		rec->sw_data += bytes;
-		if (rec->sw_data == rec->sw_buffer_size)
-			rec->sw_data = 0;
-		rec->hw_ready += bytes;
-		rec->sw_ready -= bytes;
+		writeindex = (writeindex + 1) % nentries;
+		em8300_alsa->queued += size;
+		em8300_alsa->pending += size;
+		em8300_alsa->next += size;
+		if (em8300_alsa->next >= buffer_bytes)
+			em8300_alsa->next = 0;
 	}
+
+	if (writeindex != start)
+		write_ucregister(MA_PCIWrPtr, base + writeindex * 3);
+}
+
+/*
+ * The IEC61937 device packs the frames into the bounce buffer as they are
+ * written, in the context of the writer, so that the interrupt only has to
+ * queue descriptors. Its buffer cannot be mapped, as frames written there
+ * would not be packed. The ALSA buffer holds a copy of the raw frames.
+ */
+static int snd_em8300_pcm_copy(struct snd_pcm_substream *substream, int channel,
+			       snd_pcm_uframes_t pos, void __user *buf, snd_pcm_uframes_t count)
+{
+	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	void *src = runtime->dma_area + frames_to_bytes(runtime, pos);
+
+	if (copy_from_user(src, buf, frames_to_bytes(runtime, count)))
+		return -EFAULT;
+	snd_em8300_pcm_pack(em8300_alsa,
+			    (u32 *)(em8300_alsa->bounce.area + (frames_to_bytes(runtime, pos) << 1)),
+			    src, count);
+	return 0;
 }
 
-static int snd_em8300_pcm_ack(struct snd_pcm_substream *substream)
+static int snd_em8300_pcm_silence(struct snd_pcm_substream *substream, int channel,
+				  snd_pcm_uframes_t pos, snd_pcm_uframes_t count)
 {
 	em8300_alsa_t *em8300_alsa = snd_pcm_substream_chip(substream);
-//	printk("em8300-%d: snd_em8300_pcm_ack called.\n", em->instance);
-	snd_em8300_pcm_indirect_playback_transfer(substream, &em8300_alsa->indirect,
-						  snd_em8300_pcm_trans_dma);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	void *src = runtime->dma_area + frames_to_bytes(runtime, pos);
+
+	memset(src, 0, frames_to_bytes(runtime, count));
+	snd_em8300_pcm_pack(em8300_alsa,
+			    (u32 *)(em8300_alsa->bounce.area + (frames_to_bytes(runtime, pos) << 1)),
+			    src, count);
 	return 0;
 }
 
+static struct snd_pcm_ops snd_em8300_iec61937_ops = {
+	.open =		snd_em8300_playback_open,
+	.close =	snd_em8300_playback_close,
+	.ioctl =	snd_pcm_lib_ioctl,
+	.hw_params =	snd_em8300_pcm_hw_params,
+	.hw_free =	snd_em8300_pcm_hw_free,
+	.prepare =	snd_em8300_pcm_prepare,
+	.trigger =	snd_em8300_pcm_trigger,
+	.pointer =	snd_em8300_pcm_pointer,
+	.wall_clock =	snd_em8300_pcm_wall_clock,
+	.copy =		snd_em8300_pcm_copy,
+	.silence =	snd_em8300_pcm_silence,
+};
+
 static struct snd_pcm_ops snd_em8300_playback_ops = {
 	.open =		snd_em8300_playback_open,
 	.close =	snd_em8300_playback_close,
@@ -340,7 +662,7 @@ static struct snd_pcm_ops snd_em8300_playback_ops = {
 	.prepare =	snd_em8300_pcm_prepare,
 	.trigger =	snd_em8300_pcm_trigger,
 	.pointer =	snd_em8300_pcm_pointer,
-	.ack =		snd_em8300_pcm_ack,
+	.wall_clock =	snd_em8300_pcm_wall_clock,
 };
 
 static void snd_em8300_pcm_analog_free(struct snd_pcm *pcm)
@@ -419,6 +741,44 @@ static int snd_em8300_pcm_digital(em8300_alsa_t *em8300_alsa)
 	return 0;
 }
 
+static void snd_em8300_pcm_iec61937_free(struct snd_pcm *pcm)
+{
+	snd_pcm_lib_preallocate_free_for_all(pcm);
+}
+
+static int snd_em8300_pcm_iec61937(em8300_alsa_t *em8300_alsa)
+{
+	struct em8300_s *em = em8300_alsa->em;
+	struct snd_pcm *pcm;
+	int ret;
+
+	ret = snd_pcm_new(em8300_alsa->card, "EM8300 PCM IEC61937",
+			EM8300_ALSA_IEC61937_DEVICENUM,
+			1, /* 1 playback substream */
+			0, /* 0 capture substream */
+			&pcm);
+
+	if (ret) {
+		printk(KERN_ERR "em8300-alsa: snd_em8300_pcm_iec61937 failed with err %d\n", ret);
+		return ret;
+	}
+
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_em8300_iec61937_ops);
+
+	pcm->private_data = em8300_alsa;
+	pcm->private_free = snd_em8300_pcm_iec61937_free;
+	pcm->info_flags = SNDRV_PCM_INFO_HALF_DUPLEX;
+
+	strcpy(pcm->name, "EM8300 IEC61937");
+
+	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_DEV,
+					      snd_dma_pci_data(em->pci_dev),
+					      0,
+					      EM8300_MID_BUFFER_SIZE / 2);
+
+	return 0;
+}
+
 static int snd_em8300_free(em8300_alsa_t *em8300_alsa)
 {
 	kfree(em8300_alsa);
@@ -434,7 +794,7 @@ static int snd_em8300_dev_free(struct snd_device *device)
 static int snd_em8300_create(struct snd_card *card, struct em8300_s *em, em8300_alsa_t **rem8300_alsa)
 {
 	em8300_alsa_t *em8300_alsa;
-	int err;
+	int err, i;
 	static struct snd_device_ops ops = {
 		.dev_free = snd_em8300_dev_free,
 	};
@@ -448,6 +808,16 @@ static int snd_em8300_create(struct snd_card *card, struct em8300_s *em, em8300_
 
 	em8300_alsa->em = em;
 	em8300_alsa->card = card;
+	spin_lock_init(&em8300_alsa->lock);
+
+	for (i = 0; i < ARRAY_SIZE(snd_em8300_rates); i++) {
+		if (snd_em8300_rates[i].clockgen == CLOCKGEN_SAMPFREQ_66 &&
+		    !audio_rate_66[em->instance])
+			continue;
+		em8300_alsa->rates[em8300_alsa->rate_constraint.count++] =
+			snd_em8300_rates[i].rate;
+	}
+	em8300_alsa->rate_constraint.list = em8300_alsa->rates;
 
 	if ((err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, em8300_alsa, &ops)) < 0) {
 		snd_em8300_free(em8300_alsa);
@@ -488,6 +858,11 @@ void em8300_alsa_enable_card(struct em8300_s *em)
 		return;
 	}
 
+	if ((err = snd_em8300_pcm_iec61937(em8300_alsa)) < 0) {
+		snd_card_free(card);
+		return;
+	}
+
 	strcpy(card->driver, "EM8300");
 	strcpy(card->shortname, "Sigma Designs' EM8300");
 	sprintf(card->longname, "%s at %#lx irq %d",
@@ -507,16 +882,89 @@ void em8300_alsa_disable_card(struct em8300_s *em)
 		snd_card_free(em->alsa_card);
 }
 
-void em8300_alsa_audio_interrupt(struct em8300_s *em)
+/*
+ * The substream if it is playing. Must be called with the lock held: the
+ * substream is only cleared under it, before its runtime is freed.
+ */
+static struct snd_pcm_substream *snd_em8300_pcm_running(em8300_alsa_t *em8300_alsa)
+{
+	struct snd_pcm_substream *substream = em8300_alsa->substream;
+
+	if (!substream || !substream->runtime ||
+	    substream->runtime->status->state != SNDRV_PCM_STATE_RUNNING)
+		return NULL;
+	return substream;
+}
+
+/*
+ * Position of the running playback substream, in frames since it was
+ * started, as the card reads it. Returns -ENODEV if no audio is playing.
+ */
+int em8300_alsa_get_position(struct em8300_s *em, uint32_t *frame, unsigned int *rate)
+{
+	em8300_alsa_t *em8300_alsa;
+	struct snd_pcm_runtime *runtime;
+	unsigned long flags;
+	u64 played;
+
+	if (!em->alsa_card)
+		return -ENODEV;
+
+	em8300_alsa = (em8300_alsa_t *)(em->alsa_card->private_data);
+	spin_lock_irqsave(&em8300_alsa->lock, flags);
+	if (!snd_em8300_pcm_running(em8300_alsa)) {
+		spin_unlock_irqrestore(&em8300_alsa->lock, flags);
+		return -ENODEV;
+	}
+	runtime = em8300_alsa->substream->runtime;
+	played = em8300_alsa->played + snd_em8300_pcm_played(em8300_alsa);
+	*frame = (uint32_t)div_u64(played, frames_to_bytes(runtime, 1));
+	*rate = runtime->rate;
+	spin_unlock_irqrestore(&em8300_alsa->lock, flags);
+
+	return 0;
+}
+
+/* Called from the audio fifo interrupt, with the time it was taken at */
+void em8300_alsa_audio_interrupt(struct em8300_s *em, ktime_t now)
 {
 	em8300_alsa_t *em8300_alsa = NULL;
+	struct snd_pcm_substream *substream;
+	int elapsed;
 
 	if (!em->alsa_card)
 		return;
 
 	em8300_alsa = (em8300_alsa_t *)(em->alsa_card->private_data);
-	if (em8300_alsa->substream) {
-//		printk("em8300-%d: calling snd_pcm_period_elapsed\n", em->instance);
-		snd_pcm_period_elapsed(em8300_alsa->substream);
+	spin_lock(&em8300_alsa->lock);
+	substream = snd_em8300_pcm_running(em8300_alsa);
+	if (!substream) {
+		spin_unlock(&em8300_alsa->lock);
+		return;
 	}
+	elapsed = snd_em8300_pcm_update(em8300_alsa, now);
+	snd_em8300_pcm_refill(em8300_alsa);
+	spin_unlock(&em8300_alsa->lock);
+
+	/* Takes the stream lock, which is taken before ours in the trigger */
+	if (elapsed)
+		snd_pcm_period_elapsed(substream);
+}
+
+/*
+ * Called from the VBL interrupt to sample the played position against the
+ * VBL clock. Queueing is left to the audio fifo interrupt.
+ */
+void em8300_alsa_vbl(struct em8300_s *em, ktime_t now)
+{
+	em8300_alsa_t *em8300_alsa = NULL;
+
+	if (!em->alsa_card)
+		return;
+
+	em8300_alsa = (em8300_alsa_t *)(em->alsa_card->private_data);
+	spin_lock(&em8300_alsa->lock);
+	if (snd_em8300_pcm_running(em8300_alsa))
+		snd_em8300_pcm_sample(em8300_alsa, now);
+	spin_unlock(&em8300_alsa->lock);
 }
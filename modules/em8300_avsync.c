@@ -0,0 +1,146 @@
+/*
+ * em8300_avsync.c -- keep the video clock locked to the audio clock
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+
+#include "em8300_reg.h"
+#include <linux/em8300.h>
+#include "em8300_driver.h"
+
+/*
+ * Once userspace told us the PTS of some audio frame, the audio clock is
+ * known from the ALSA playback position. Every few VBLs, the SCR is
+ * compared to it, and MV_SCRSpeed is nudged around its nominal value by a
+ * PI controller, so that video drifts back in sync without skipping
+ * frames. Only a drift too large to catch up that way makes the SCR jump.
+ */
+
+/* Nominal SCR speed, as set up by em8300_video_setup */
+#define EM8300_AVSYNC_SPEED 0x900
+
+/* Run the controller every that many VBLs */
+#define EM8300_AVSYNC_PERIOD 8
+
+/* Drift, in 90kHz ticks, beyond which the SCR is set rather than slewed */
+#define EM8300_AVSYNC_MAX_ERROR 45000
+
+/* Gains, as divisors of the drift in 90kHz ticks, and speed correction bound */
+#define EM8300_AVSYNC_KP 256
+#define EM8300_AVSYNC_KI 4096
+#define EM8300_AVSYNC_MAX_ADJUST (EM8300_AVSYNC_SPEED / 50)
+
+void em8300_avsync_init(struct em8300_s *em)
+{
+	spin_lock_init(&em->avsync.lock);
+	em->avsync.speed = EM8300_AVSYNC_SPEED;
+}
+
+/*
+ * Called whenever MV_SCRSpeed was written behind the controller's back, by
+ * a play mode change or EM8300_IOCTL_SCR_SETSPEED. The speed it last set
+ * is then unknown, so that its next run writes its own again.
+ */
+void em8300_avsync_speed_changed(struct em8300_s *em)
+{
+	struct em8300_avsync_s *s = &em->avsync;
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->speed = -1;
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+int em8300_avsync_set(struct em8300_s *em, const em8300_avsync_t *avsync)
+{
+	struct em8300_avsync_s *s = &em->avsync;
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (avsync->enable) {
+		s->pts = avsync->pts;
+		s->frame = avsync->frame;
+		s->integral = 0;
+		s->vblcount = 0;
+	} else if (s->enabled) {
+		s->speed = EM8300_AVSYNC_SPEED;
+		em8300_video_setspeed(em, s->speed);
+	}
+	s->enabled = avsync->enable;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	return 0;
+}
+
+/* Called from the VBL interrupt */
+void em8300_avsync_vbl(struct em8300_s *em)
+{
+	struct em8300_avsync_s *s = &em->avsync;
+	uint32_t frame, audio, scr;
+	unsigned int rate;
+	long adjust;
+	int error;
+
+	spin_lock(&s->lock);
+
+	if (!s->enabled || em->video_playmode != EM8300_PLAYMODE_PLAY)
+		goto out;
+	if (++s->vblcount < EM8300_AVSYNC_PERIOD)
+		goto out;
+	s->vblcount = 0;
+
+	if (em8300_alsa_get_position(em, &frame, &rate) || !rate)
+		goto out;
+
+	audio = s->pts + (uint32_t)div_u64((u64)(frame - s->frame) * 90000, rate);
+	scr = (read_ucregister(MV_SCRlo) | (read_ucregister(MV_SCRhi) << 16)) << 1;
+	error = (int)(audio - scr);
+	s->error = error;
+
+	if (error > EM8300_AVSYNC_MAX_ERROR || error < -EM8300_AVSYNC_MAX_ERROR) {
+		write_ucregister(MV_SCRlo, (audio >> 1) & 0xffff);
+		write_ucregister(MV_SCRhi, (audio >> 17) & 0xffff);
+		s->integral = 0;
+		s->speed = EM8300_AVSYNC_SPEED;
+		em8300_video_setspeed(em, s->speed);
+		s->jumps++;
+		goto out;
+	}
+
+	s->integral += error;
+	if (s->integral > (long)EM8300_AVSYNC_MAX_ADJUST * EM8300_AVSYNC_KI)
+		s->integral = (long)EM8300_AVSYNC_MAX_ADJUST * EM8300_AVSYNC_KI;
+	if (s->integral < -(long)EM8300_AVSYNC_MAX_ADJUST * EM8300_AVSYNC_KI)
+		s->integral = -(long)EM8300_AVSYNC_MAX_ADJUST * EM8300_AVSYNC_KI;
+
+	/* Video late (audio ahead) means the SCR must run faster */
+	adjust = error / EM8300_AVSYNC_KP + s->integral / EM8300_AVSYNC_KI;
+	if (adjust > EM8300_AVSYNC_MAX_ADJUST)
+		adjust = EM8300_AVSYNC_MAX_ADJUST;
+	if (adjust < -EM8300_AVSYNC_MAX_ADJUST)
+		adjust = -EM8300_AVSYNC_MAX_ADJUST;
+
+	if (EM8300_AVSYNC_SPEED + adjust != s->speed) {
+		s->speed = EM8300_AVSYNC_SPEED + adjust;
+		em8300_video_setspeed(em, s->speed);
+		s->corrections++;
+	}
+
+out:
+	spin_unlock(&s->lock);
+}
@@ -0,0 +1,242 @@
+/*
+ * em8300_debugfs.c -- debugfs statistics for the em8300 driver
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "em8300_reg.h"
+#include <linux/em8300.h>
+#include "em8300_driver.h"
+#include "em8300_fifo.h"
+
+/*
+ * Each card gets a directory named after its v4l2 device (em8300-N), with
+ * one file per fifo. Reading a file shows the counters since the fifo was
+ * set up; writing anything to it resets them. video_stall counts the
+ * recovery steps taken by em8300_video_stall_check, avsync shows the
+ * state of the A/V sync engine, and vbl the timing of the VBL interrupts
+ * (writing to it resets the statistics as well).
+ */
+
+static int em8300_debugfs_fifo_show(struct seq_file *m, void *v)
+{
+	struct fifo_s *fifo = *(struct fifo_s **)m->private;
+	struct fifo_stats_s *stats;
+	int i;
+
+	if (!fifo || !fifo->valid) {
+		seq_puts(m, "not initialized\n");
+		return 0;
+	}
+	stats = &fifo->stats;
+
+	seq_printf(m, "slots: %d x %d bytes\n", fifo->nslots, fifo->slotsize);
+	if (fifo->adaptive)
+		seq_printf(m, "threshold: %d (adaptive, drain rate %d slots/s)\n",
+			   fifo->threshold, fifo->drain_rate);
+	else
+		seq_printf(m, "threshold: %d\n", fifo->threshold);
+	seq_printf(m, "queued: %d\n", fifo->nslots - 1 - em8300_fifo_freeslots(fifo));
+	seq_printf(m, "bytes written: %llu\n", stats->bytes);
+	seq_printf(m, "slots written: %llu\n", stats->slots);
+	seq_printf(m, "occupancy low: %d\n", stats->low_occupancy);
+	seq_printf(m, "occupancy high: %d\n", stats->high_occupancy);
+	seq_printf(m, "waits: %lu\n", stats->waits);
+	seq_printf(m, "wait time: %llu us\n", stats->wait_us);
+	seq_printf(m, "restarts: %lu\n", stats->restarts);
+
+	seq_puts(m, "wait histogram (us):\n");
+	for (i = 0; i < EM8300_FIFO_WAIT_BUCKETS; i++) {
+		if (!stats->wait_hist[i])
+			continue;
+		seq_printf(m, "  %8lu - %8lu: %lu\n",
+			   i ? 1UL << i : 0, (1UL << (i + 1)) - 1, stats->wait_hist[i]);
+	}
+
+	return 0;
+}
+
+static int em8300_debugfs_stall_show(struct seq_file *m, void *v)
+{
+	struct em8300_s *em = m->private;
+
+	seq_printf(m, "syncs: %lu\n", em->stall_syncs);
+	seq_printf(m, "flushes: %lu\n", em->stall_flushes);
+	seq_printf(m, "restarts: %lu\n", em->stall_restarts);
+	seq_printf(m, "failures: %lu\n", em->stall_failures);
+
+	return 0;
+}
+
+static int em8300_debugfs_stall_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, em8300_debugfs_stall_show, inode->i_private);
+}
+
+static const struct file_operations em8300_debugfs_stall_fops = {
+	.owner   = THIS_MODULE,
+	.open    = em8300_debugfs_stall_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static int em8300_debugfs_avsync_show(struct seq_file *m, void *v)
+{
+	struct em8300_s *em = m->private;
+	struct em8300_avsync_s *s = &em->avsync;
+
+	seq_printf(m, "enabled: %d\n", s->enabled);
+	seq_printf(m, "drift: %d ticks\n", s->error);
+	seq_printf(m, "integral: %ld\n", s->integral);
+	if (s->speed < 0)
+		seq_printf(m, "speed: unknown\n");
+	else
+		seq_printf(m, "speed: 0x%x\n", s->speed);
+	seq_printf(m, "corrections: %lu\n", s->corrections);
+	seq_printf(m, "jumps: %lu\n", s->jumps);
+
+	return 0;
+}
+
+static int em8300_debugfs_avsync_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, em8300_debugfs_avsync_show, inode->i_private);
+}
+
+static const struct file_operations em8300_debugfs_avsync_fops = {
+	.owner   = THIS_MODULE,
+	.open    = em8300_debugfs_avsync_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static void em8300_debugfs_show_hist(struct seq_file *m, const char *name,
+				     const unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "%s histogram (us):\n", name);
+	for (i = 0; i < EM8300_VBL_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		seq_printf(m, "  %8lu - %8lu: %lu\n",
+			   i ? 1UL << i : 0, (1UL << (i + 1)) - 1, hist[i]);
+	}
+}
+
+static int em8300_debugfs_vbl_show(struct seq_file *m, void *v)
+{
+	struct em8300_s *em = m->private;
+	struct em8300_vbl_stats_s stats = em->vbl_stats;
+
+	seq_printf(m, "sequence: %d\n", em->irqcount);
+	seq_printf(m, "timestamp: %lld ns\n", ktime_to_ns(em->vbl_time));
+	seq_printf(m, "interrupts: %lu\n", stats.count);
+	seq_printf(m, "missed: %lu\n", stats.missed);
+	seq_printf(m, "period min: %lld ns\n", stats.period_min);
+	seq_printf(m, "period avg: %lld ns\n", stats.period_avg);
+	seq_printf(m, "period max: %lld ns\n", stats.period_max);
+	seq_printf(m, "latency max: %lld ns\n", stats.latency_max);
+	em8300_debugfs_show_hist(m, "jitter", stats.jitter_hist);
+	em8300_debugfs_show_hist(m, "latency", stats.latency_hist);
+
+	return 0;
+}
+
+static int em8300_debugfs_vbl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, em8300_debugfs_vbl_show, inode->i_private);
+}
+
+static ssize_t em8300_debugfs_vbl_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct em8300_s *em = m->private;
+
+	/* the statistics belong to the interrupt handler, which clears them */
+	em->vbl_stats_reset = 1;
+
+	return count;
+}
+
+static const struct file_operations em8300_debugfs_vbl_fops = {
+	.owner   = THIS_MODULE,
+	.open    = em8300_debugfs_vbl_open,
+	.read    = seq_read,
+	.write   = em8300_debugfs_vbl_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static int em8300_debugfs_fifo_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, em8300_debugfs_fifo_show, inode->i_private);
+}
+
+static ssize_t em8300_debugfs_fifo_write(struct file *file, const char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct fifo_s *fifo = *(struct fifo_s **)m->private;
+
+	if (fifo && fifo->valid) {
+		mutex_lock(&fifo->lock);
+		em8300_fifo_reset_stats(fifo);
+		mutex_unlock(&fifo->lock);
+	}
+
+	return count;
+}
+
+static const struct file_operations em8300_debugfs_fifo_fops = {
+	.owner   = THIS_MODULE,
+	.open    = em8300_debugfs_fifo_open,
+	.read    = seq_read,
+	.write   = em8300_debugfs_fifo_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+void em8300_debugfs_init(struct em8300_s *em)
+{
+	em->debugfs_dir = debugfs_create_dir(em->v4l2_dev.name, NULL);
+	if (IS_ERR_OR_NULL(em->debugfs_dir)) {
+		em->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("mvfifo", 0600, em->debugfs_dir, &em->mvfifo,
+			    &em8300_debugfs_fifo_fops);
+	debugfs_create_file("spfifo", 0600, em->debugfs_dir, &em->spfifo,
+			    &em8300_debugfs_fifo_fops);
+	debugfs_create_file("video_stall", 0400, em->debugfs_dir, em,
+			    &em8300_debugfs_stall_fops);
+	debugfs_create_file("avsync", 0400, em->debugfs_dir, em,
+			    &em8300_debugfs_avsync_fops);
+	debugfs_create_file("vbl", 0600, em->debugfs_dir, em,
+			    &em8300_debugfs_vbl_fops);
+}
+
+void em8300_debugfs_exit(struct em8300_s *em)
+{
+	debugfs_remove_recursive(em->debugfs_dir);
+	em->debugfs_dir = NULL;
+}
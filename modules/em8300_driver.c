@@ -26,6 +26,7 @@
 #endif
 
 #include <linux/interrupt.h>
+#include <linux/math64.h>
 
 
 #include "em8300_reg.h"
@@ -57,9 +58,77 @@ static DEFINE_PCI_DEVICE_TABLE(em8300_ids) = {
 
 MODULE_DEVICE_TABLE(pci, em8300_ids);
 
+static void em8300_vbl_hist(unsigned long *hist, s64 ns)
+{
+	unsigned long us = (unsigned long)div_s64(ns, 1000);
+	int bucket = us > 1 ? ilog2(us) : 0;
+
+	if (bucket >= EM8300_VBL_HIST_BUCKETS)
+		bucket = EM8300_VBL_HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+/*
+ * Account the VBL interrupt at now. The jitter is the deviation of each
+ * period from the average one. The latency is estimated against the
+ * earliest arrivals seen: vbl_expected predicts the next VBL from the
+ * average period, snaps back whenever an interrupt comes earlier than
+ * predicted, and only slowly follows late ones.
+ */
+static void em8300_vbl_account(struct em8300_s *em, ktime_t now)
+{
+	struct em8300_vbl_stats_s *stats = &em->vbl_stats;
+	s64 period, jitter, late;
+
+	if (em->vbl_stats_reset) {
+		memset(stats, 0, sizeof(*stats));
+		em->vbl_stats_reset = 0;
+	}
+
+	period = ktime_to_ns(ktime_sub(now, em->vbl_time));
+	em->vbl_time = now;
+
+	if (!stats->count++) {
+		em->vbl_expected = now;
+		return;
+	}
+	if (stats->count == 2) {
+		stats->period_min = stats->period_max = stats->period_avg = period;
+		em->vbl_expected = now;
+		return;
+	}
+
+	if (period > stats->period_avg + stats->period_avg / 2) {
+		stats->missed++;
+		em->vbl_expected = now;
+		return;
+	}
+
+	if (period < stats->period_min)
+		stats->period_min = period;
+	if (period > stats->period_max)
+		stats->period_max = period;
+	jitter = period - stats->period_avg;
+	em8300_vbl_hist(stats->jitter_hist, jitter < 0 ? -jitter : jitter);
+	stats->period_avg += div_s64(period - stats->period_avg, 16);
+
+	late = ktime_to_ns(ktime_sub(now, em->vbl_expected)) - stats->period_avg;
+	if (late < 0) {
+		em->vbl_expected = now;
+		late = 0;
+	} else {
+		em->vbl_expected = ktime_add_ns(em->vbl_expected,
+						stats->period_avg + div_s64(late, 64));
+	}
+	if (late > stats->latency_max)
+		stats->latency_max = late;
+	em8300_vbl_hist(stats->latency_hist, late);
+}
+
 static irqreturn_t em8300_irq(int irq, void *dev_id)
 {
 	struct em8300_s *em = (struct em8300_s *) dev_id;
+	ktime_t now = ktime_get();
 	int irqstatus;
 	struct timeval tv;
 
@@ -71,22 +140,32 @@ static irqreturn_t em8300_irq(int irq, void *dev_id)
 
 		write_ucregister(Q_IrqStatus, 0x8000);
 
-		if (irqstatus & IRQSTATUS_VIDEO_FIFO)
+		if (irqstatus & IRQSTATUS_VIDEO_FIFO) {
 			em8300_fifo_check(em->mvfifo);
+			em8300_video_drain_check(em);
+			em8300_vb2_irq(em);
+		}
 
 		if (irqstatus & IRQSTATUS_AUDIO_FIFO)
-			em8300_alsa_audio_interrupt(em);
+			em8300_alsa_audio_interrupt(em, now);
 
 		if (irqstatus & IRQSTATUS_VIDEO_VBL) {
 			em8300_fifo_check(em->spfifo);
+			em8300_fifo_poll(em->mvfifo);
 			em8300_video_check_ptsfifo(em);
 			em8300_spu_check_ptsfifo(em);
+			em8300_alsa_vbl(em, now);
+			em8300_avsync_vbl(em);
+			em8300_video_drain_check(em);
+			em8300_vb2_irq(em);
 
 			do_gettimeofday(&tv);
 			em->irqtimediff = TIMEDIFF(tv, em->tv);
 			em->tv = tv;
 			em->irqcount++;
+			em8300_vbl_account(em, now);
 			wake_up(&em->vbi_wait);
+			em8300_video_queue_vbl_event(em);
 		}
 
 		write_ucregister(Q_IrqMask, em->irqmask);
@@ -107,6 +186,8 @@ static void release_em8300(struct em8300_s *em)
 
 	em8300_i2c_exit(em);
 
+	em8300_debugfs_exit(em);
+
 	write_ucregister(Q_IrqMask, 0);
 	write_ucregister(Q_IrqStatus, 0);
 	write_register(RESET, 0);
@@ -123,6 +204,7 @@ static void release_em8300(struct em8300_s *em)
 	iounmap((unsigned *) em->mem);
 
 	video_unregister_device(em->vdev);
+	em8300_vb2_exit(em);
 	v4l2_device_unregister(&em->v4l2_dev);
 	kfree(em);
 }
@@ -315,7 +397,12 @@ static int __devinit em8300_probe(struct pci_dev *pdev,
 #endif
 
 	init_waitqueue_head(&em->video_ptsfifo_wait);
+	INIT_KFIFO(em->video_ptsqueue);
+	spin_lock_init(&em->video_ptsqueue_lock);
+	em8300_avsync_init(em);
 	init_waitqueue_head(&em->vbi_wait);
+	init_waitqueue_head(&em->video_drain_wait);
+	atomic_set(&em->vbl_subscribers, 0);
 	init_waitqueue_head(&em->sp_ptsfifo_wait);
 
 	retval = request_irq(pdev->irq, em8300_irq,
@@ -335,6 +422,8 @@ static int __devinit em8300_probe(struct pci_dev *pdev,
 		goto irq_error;
 	}
 
+	em8300_debugfs_init(em);
+
 	return 0;
 
 irq_error:
@@ -42,11 +42,16 @@
 #include <linux/list.h> /* struct list_head */
 #include <linux/semaphore.h> /* struct semaphore */
 #include <linux/mutex.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-chip-ident.h>
 #include <media/v4l2-ctrls.h>
+#include <media/v4l2-fh.h>
+#include <media/v4l2-event.h>
+#include <media/videobuf2-core.h>
 
 
 /* debugging */
@@ -157,6 +162,46 @@ typedef struct {
 	int saturation;
 } em8300_bcs_t;
 
+/* A video PTS waiting for a free entry in the PTS fifo of the card */
+struct em8300_pts_s {
+	uint32_t pts;
+	int offset;
+};
+
+#define EM8300_VIDEO_PTSQUEUE 256
+
+/* Default size of the buffers of the streaming output queue */
+#define EM8300_VIDEO_BUFSIZE (128 * 1024)
+
+/* State of the A/V sync engine (em8300_avsync.c) */
+struct em8300_avsync_s {
+	spinlock_t lock;
+	int enabled;
+	uint32_t pts;		/* audio PTS, in 90kHz ticks, at frame */
+	uint32_t frame;
+	int vblcount;
+	int error;		/* last measured video - audio drift, in 90kHz ticks */
+	long integral;
+	int speed;
+	unsigned long corrections;
+	unsigned long jumps;
+};
+
+#define EM8300_VBL_HIST_BUCKETS 16
+
+/* VBL interrupt timing, in ns, reset by setting vbl_stats_reset */
+struct em8300_vbl_stats_s {
+	unsigned long count;
+	unsigned long missed;	/* periods over 1.5 times the average */
+	s64 period_min;
+	s64 period_max;
+	s64 period_avg;		/* smoothed over about 16 periods */
+	s64 latency_max;
+	/* by ilog2 of the deviation in us, the first bucket holds 0 and 1 */
+	unsigned long jitter_hist[EM8300_VBL_HIST_BUCKETS];
+	unsigned long latency_hist[EM8300_VBL_HIST_BUCKETS];
+};
+
 struct em8300_s
 {
 	int chip_revision;
@@ -167,6 +212,18 @@ struct em8300_s
 	struct v4l2_device v4l2_dev;
 	struct v4l2_subdev *encoder;
 	struct video_device *vdev;
+	struct mutex video_lock;
+
+	/* Streaming output (em8300_vb2.c) */
+	struct vb2_queue vb_queue;
+	void *vb_alloc_ctx;
+	spinlock_t vb_lock;
+	struct list_head vb_pending;	/* queued, not fully in the fifo yet */
+	struct list_head vb_active;	/* in the fifo, not fully read yet */
+	int vb_fed;			/* bytes of the first pending buffer in the fifo */
+	int vb_pts_queued;
+	int vb_streaming;
+	struct work_struct vb_work;
 
 	/* Control handler */
 	struct v4l2_ctrl_handler ctrl_handler;
@@ -220,13 +277,20 @@ struct em8300_s
 	/* Timing measurement */
 	struct timeval tv, last_status_time;
 	long irqtimediff;
-	int irqcount;
+	int irqcount;		/* also the sequence number of the last VBL */
+	ktime_t vbl_time;	/* CLOCK_MONOTONIC at the last VBL interrupt */
+	ktime_t vbl_expected;
+	struct em8300_vbl_stats_s vbl_stats;
+	int vbl_stats_reset;
 	int frames;
 	int scr;
 	
 	/* Audio */
 	struct snd_card *alsa_card;
 
+	/* A/V sync */
+	struct em8300_avsync_s avsync;
+
 	/* Video */
 	v4l2_std_id video_mode;
 	int video_playmode;
@@ -237,10 +301,29 @@ struct em8300_s
 	int video_ptsvalid,video_offset,video_count;
 	int video_ptsfifo_ptr;
 	wait_queue_head_t video_ptsfifo_wait;
+	DECLARE_KFIFO(video_ptsqueue, struct em8300_pts_s, EM8300_VIDEO_PTSQUEUE);
+	spinlock_t video_ptsqueue_lock;
 	wait_queue_head_t vbi_wait;
+	atomic_t vbl_subscribers;
 	int video_ptsfifo_waiting;
 	int video_first;
+	int video_scan_drop;	/* dropping data of a non-intra picture */
+	unsigned char video_scan_carry[8];	/* undecided start code of the last write */
+	int video_scan_carried;
+	uint32_t video_pts_delta;	/* clip time base to timeline, in 90kHz ticks */
+	uint32_t video_segment_end;	/* latest PTS queued, in 45kHz ticks */
+	int video_segment_valid;
+	int video_drain;	/* EM8300_DRAIN_* */
+	unsigned video_drain_rdptr;
+	int video_drain_idle;
+	wait_queue_head_t video_drain_wait;
 	int var_video_value;
+
+	/* Video decoder stall recovery */
+	unsigned long stall_syncs;
+	unsigned long stall_flushes;
+	unsigned long stall_restarts;
+	unsigned long stall_failures;
 	
 	/* Sub Picture */
 	int sp_pts, sp_ptsvalid, sp_count;
@@ -253,8 +336,32 @@ struct em8300_s
 
 	struct em8300_config_s config;
 	u16 instance;
+
+	/* debugfs */
+	struct dentry *debugfs_dir;
 };
 
+/* Stall detection for a writer waiting on a full fifo */
+struct em8300_stall_s {
+	struct fifo_s *fifo;
+	unsigned rdptr;
+	unsigned framecnt;
+	int readptr;
+	int stage;
+	int idle;
+};
+
+/* Recovery steps taken by em8300_video_stall_check */
+#define EM8300_STALL_NONE 0
+#define EM8300_STALL_SYNC 1
+#define EM8300_STALL_FLUSH 2
+#define EM8300_STALL_RESTART 3
+
+/* States of a drain of the video decoder */
+#define EM8300_DRAIN_NONE 0
+#define EM8300_DRAIN_ACTIVE 1
+#define EM8300_DRAIN_DONE 2
+
 #define TIMEDIFF(a,b) a.tv_usec - b.tv_usec + \
 	    1000000 * (a.tv_sec - b.tv_sec)
 
@@ -263,10 +370,27 @@ struct em8300_s
   Prototypes
 */
 
+/* em8300_avsync.c */
+void em8300_avsync_init(struct em8300_s *em);
+void em8300_avsync_speed_changed(struct em8300_s *em);
+int em8300_avsync_set(struct em8300_s *em, const em8300_avsync_t *avsync);
+void em8300_avsync_vbl(struct em8300_s *em);
+
+/* em8300_vb2.c */
+int em8300_vb2_init(struct em8300_s *em);
+void em8300_vb2_exit(struct em8300_s *em);
+void em8300_vb2_irq(struct em8300_s *em);
+
+/* em8300_debugfs.c */
+void em8300_debugfs_init(struct em8300_s *em);
+void em8300_debugfs_exit(struct em8300_s *em);
+
 /* em8300_alsa.c */
 void em8300_alsa_enable_card(struct em8300_s *em);
 void em8300_alsa_disable_card(struct em8300_s *em);
-void em8300_alsa_audio_interrupt(struct em8300_s *em);
+void em8300_alsa_audio_interrupt(struct em8300_s *em, ktime_t now);
+void em8300_alsa_vbl(struct em8300_s *em, ktime_t now);
+int em8300_alsa_get_position(struct em8300_s *em, uint32_t *frame, unsigned int *rate);
 
 /* em8300_i2c.c */
 int em8300_i2c_init(struct em8300_s *em);
@@ -307,13 +431,20 @@ void em8300_video_open(struct em8300_s *em);
 int em8300_video_setplaymode(struct em8300_s *em, int mode);
 int em8300_video_sync(struct em8300_s *em);
 int em8300_video_flush(struct em8300_s *em);
+int em8300_video_discontinuity(struct em8300_s *em);
 int em8300_video_setup(struct em8300_s *em);
 int em8300_video_release(struct em8300_s *em);
 void em8300_video_setspeed(struct em8300_s *em, int speed);
 ssize_t em8300_video_write(struct em8300_s *em, const char * buf,
-		       size_t count, loff_t *ppos);
-int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg);
+		       size_t count, loff_t *ppos, int nonblock);
+int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg, int nonblock);
 void em8300_video_check_ptsfifo(struct em8300_s *em);
+void em8300_video_drain_check(struct em8300_s *em);
+int em8300_video_push_stream_pts(struct em8300_s *em, uint32_t pts);
+void em8300_video_queue_vbl_event(struct em8300_s *em);
+int em8300_video_subscribe_event(struct v4l2_fh *fh, struct v4l2_event_subscription *sub);
+void em8300_video_stall_start(struct em8300_s *em, struct em8300_stall_s *stall, struct fifo_s *fifo);
+int em8300_video_stall_check(struct em8300_s *em, struct em8300_stall_s *stall);
 
 /* em8300_spu.c */
 ssize_t em8300_spu_write(struct em8300_s *em, const char * buf,
@@ -321,6 +452,8 @@ ssize_t em8300_spu_write(struct em8300_s *em, const char * buf,
 int em8300_spu_open(struct em8300_s *em);
 int em8300_spu_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg);
 int em8300_spu_init(struct em8300_s *em);
+void em8300_spu_drop(struct em8300_s *em);
+int em8300_spu_flush(struct em8300_s *em);
 void em8300_spu_check_ptsfifo(struct em8300_s *em);
 int em8300_ioctl_setspumode(struct em8300_s *em, int mode);
 void em8300_spu_release(struct em8300_s *em);
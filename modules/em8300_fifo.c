@@ -18,21 +18,349 @@
 */
 
 #include <linux/pci.h>
+#include <linux/mm.h>
+#include <linux/io.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
 #include "em8300_reg.h"
 #include <linux/em8300.h>
 #include "em8300_driver.h"
 #include "em8300_fifo.h"
 
+/* Writes smaller than this are cheaper to copy than to pin */
+#define EM8300_FIFO_ZEROCOPY_MIN 2048
+
+/* How often a writer on a full fifo checks that the decoder makes progress */
+#define EM8300_FIFO_STALL_TIMEOUT HZ
+
+/*
+ * In adaptive mode, writers are woken while the slots still queued last
+ * this long, which must cover their wakeup and refill latency.
+ */
+#define EM8300_FIFO_ADAPTIVE_LATENCY_MS 20
+
+/* Bounds for runtime-configured slot sizes */
+#define EM8300_FIFO_SLOTSIZE_MIN 0x100
+#define EM8300_FIFO_SLOTSIZE_MAX 0x10000
+
 /*
  * Keep in mind that this FIFOs are only for video and spu, which are the same
  * in respect of used routines.
+ *
+ * Each fifo is a single-producer/single-consumer ring: the writer holding
+ * fifo->lock is the only one to move the write pointer, and the card is the
+ * only one to move the read pointer. The slot descriptors are published
+ * before the write pointer (em8300_fifo_commit), and the read pointer is
+ * sampled once before the slots it frees are reused. The lock only covers
+ * filling the slots; nobody sleeps with it held.
+ *
+ * With a staging ring, writers only append to the ring and the slots are
+ * refilled from it by em8300_fifo_refill, kicked by the writer and by the
+ * fifo interrupt through refill_work. Both run with fifo->lock held, so the
+ * slot side keeps a single producer.
+ */
+
+static void em8300_fifo_refill_work(struct work_struct *work);
+
+static void em8300_fifo_setaddr(struct fifo_s *fifo, int index, dma_addr_t phys)
+{
+	fifo->shadow[index].physaddress_hi = phys >> 16;
+	fifo->shadow[index].physaddress_lo = phys & 0xffff;
+}
+
+/*
+ * Register access for a fifo whose pointers and descriptors live in the
+ * microcode registers of the card.
+ */
+static int em8300_fifo_mmio_get_readptr(struct fifo_s *fifo)
+{
+	return readl(fifo->readptr);
+}
+
+static int em8300_fifo_mmio_get_writeptr(struct fifo_s *fifo)
+{
+	return readl(fifo->writeptr);
+}
+
+static void em8300_fifo_mmio_set_readptr(struct fifo_s *fifo, int ptr)
+{
+	writel(ptr, fifo->readptr);
+}
+
+static void em8300_fifo_mmio_set_writeptr(struct fifo_s *fifo, int ptr)
+{
+	writel(ptr, fifo->writeptr);
+}
+
+static int em8300_fifo_mmio_get_size(struct fifo_s *fifo)
+{
+	struct em8300_s *em = fifo->em;
+
+	return read_ucregister(fifo->reg_pcisize);
+}
+
+static void em8300_fifo_mmio_set_size(struct fifo_s *fifo, int size)
+{
+	struct em8300_s *em = fifo->em;
+
+	write_ucregister(fifo->reg_pcisize, size);
+}
+
+/*
+ * Copy count slot descriptors, starting at index, from the host copy to the
+ * card. Only the words that differ from what the card holds are written: on
+ * the copy path the address of a slot does not change, so that is mostly
+ * its size, if even that.
+ */
+static void em8300_fifo_mmio_publish(struct fifo_s *fifo, int index, int count)
+{
+	u32 *src, *dst, *card;
+	int i, w;
+
+	for (i = 0; i < count; i++) {
+		src = (u32 *)&fifo->shadow[index];
+		dst = (u32 *)&fifo->published[index];
+		card = (u32 *)&fifo->slots.v[index];
+		for (w = 0; w < sizeof(struct video_fifoslot_s) / 4; w++) {
+			if (src[w] != dst[w]) {
+				writel(src[w], card + w);
+				dst[w] = src[w];
+			}
+		}
+		index = (index + 1) % fifo->nslots;
+	}
+}
+
+static const struct fifo_ops_s em8300_fifo_mmio_ops = {
+	.get_readptr = em8300_fifo_mmio_get_readptr,
+	.get_writeptr = em8300_fifo_mmio_get_writeptr,
+	.set_readptr = em8300_fifo_mmio_set_readptr,
+	.set_writeptr = em8300_fifo_mmio_set_writeptr,
+	.get_size = em8300_fifo_mmio_get_size,
+	.set_size = em8300_fifo_mmio_set_size,
+	.publish = em8300_fifo_mmio_publish,
+};
+
+/*
+ * Make count descriptors, written starting at index, visible to the card
+ * with a single write pointer update.
+ */
+static void em8300_fifo_commit(struct fifo_s *fifo, int index, int count)
+{
+	int i;
+
+	if (!count)
+		return;
+
+	for (i = 0; i < count; i++)
+		fifo->stats.bytes += fifo->shadow[(index + i) % fifo->nslots].slotsize;
+	fifo->stats.slots += count;
+	fifo->committed += count;
+
+	fifo->ops->publish(fifo, index, count);
+	wmb();
+	fifo->ops->set_writeptr(fifo, em8300_fifo_index2ptr(fifo, index + count));
+}
+
+/*
+ * Unpin the user page a slot points to, if any, and make the host copy of
+ * the slot point back to its part of the bounce buffer. Must be called
+ * with slotref_lock held.
  */
+static void em8300_fifo_release_slot(struct fifo_s *fifo, int index)
+{
+	struct fifo_slotref_s *ref = &fifo->slotref[index];
+
+	if (!ref->size)
+		return;
+
+	if (ref->page) {
+		pci_unmap_page(fifo->em->pci_dev, ref->dma, ref->size, PCI_DMA_TODEVICE);
+		put_page(ref->page);
+		ref->page = NULL;
+	}
+	ref->size = 0;
+
+	em8300_fifo_setaddr(fifo, index, fifo->phys_base + index * fifo->slotsize);
+}
+
+/*
+ * Release the pages of all the slots the card has read, up to readindex.
+ * Writers must use the same readindex to compute the free slots they fill,
+ * otherwise a slot could be reclaimed before the card had a chance to read it.
+ * Returns the number of slots reclaimed.
+ */
+static int em8300_fifo_reclaim(struct fifo_s *fifo, int readindex)
+{
+	unsigned long irqflags;
+	int n = 0;
 
-int em8300_fifo_init(struct em8300_s *em, struct fifo_s *f, int start, int wrptr, int rdptr, int pcisize, int slotsize)
+	/*
+	 * em8300_fifo_configure swaps the arrays under slotref_lock, readindex
+	 * may still come from the old geometry
+	 */
+	spin_lock_irqsave(&fifo->slotref_lock, irqflags);
+	while (fifo->slotref && readindex < fifo->nslots && fifo->reclaimindex != readindex) {
+		em8300_fifo_release_slot(fifo, fifo->reclaimindex);
+		fifo->reclaimed++;
+		fifo->reclaimindex++;
+		fifo->reclaimindex %= fifo->nslots;
+		n++;
+	}
+	spin_unlock_irqrestore(&fifo->slotref_lock, irqflags);
+
+	return n;
+}
+
+/* Drop the page references of a slotref array that is no longer in use */
+static void em8300_fifo_put_slotref(struct fifo_s *f, struct fifo_slotref_s *slotref, int nslots)
 {
 	int i;
-	dma_addr_t phys;
 
+	for (i = 0; i < nslots; i++) {
+		if (slotref[i].page) {
+			pci_unmap_page(f->em->pci_dev, slotref[i].dma, slotref[i].size, PCI_DMA_TODEVICE);
+			put_page(slotref[i].page);
+		}
+	}
+	kfree(slotref);
+}
+
+static void em8300_fifo_release(struct fifo_s *f)
+{
+	if (f->slotref) {
+		em8300_fifo_put_slotref(f, f->slotref, f->nslots);
+		f->slotref = NULL;
+	}
+	if (f->fifobuffer) {
+		pci_free_consistent(f->em->pci_dev, f->nslots * f->slotsize, f->fifobuffer, f->phys_base);
+		f->fifobuffer = NULL;
+	}
+	kfree(f->shadow);
+	f->shadow = NULL;
+	kfree(f->published);
+	f->published = NULL;
+}
+
+/*
+ * (Re)build the fifo with the given geometry. nslots may not exceed the
+ * size of the descriptor table the microcode set up; 0 selects the whole
+ * table, a threshold of 0 selects half of the slots and a threshold of -1
+ * lets em8300_fifo_adapt pick it. The fifo must be empty.
+ *
+ * The new buffers are allocated before the old ones are dropped, so a
+ * failure leaves the fifo as it was. The interrupt handler reclaims slots
+ * under slotref_lock, which is why the arrays are swapped while holding it.
+ */
+static int em8300_fifo_configure(struct fifo_s *f, int nslots, int slotsize, int threshold)
+{
+	int i, zerocopy = f->zerocopy, adaptive = 0;
+	struct video_fifoslot_s *shadow, *published, *old_shadow, *old_published;
+	struct fifo_slotref_s *slotref = NULL, *old_slotref;
+	char *fifobuffer, *old_fifobuffer;
+	dma_addr_t phys_base, old_phys_base;
+	int old_nslots, old_slotsize;
+	unsigned long irqflags;
+
+	if (!nslots)
+		nslots = f->maxslots;
+	if (!threshold)
+		threshold = nslots / 2;
+	if (threshold == -1) {
+		/* Wake up writers early until the drain rate is known */
+		adaptive = 1;
+		threshold = 1;
+	}
+
+	if (nslots < 2 || nslots > f->maxslots)
+		return -EINVAL;
+	if (slotsize < EM8300_FIFO_SLOTSIZE_MIN || slotsize > EM8300_FIFO_SLOTSIZE_MAX || (slotsize & 3))
+		return -EINVAL;
+	if (threshold < 1 || threshold >= nslots)
+		return -EINVAL;
+	if (f->mapped || f->streaming)
+		return -EBUSY;
+
+	fifobuffer = pci_alloc_consistent(f->em->pci_dev, nslots * slotsize, &phys_base);
+	if (fifobuffer == NULL)
+		return -ENOMEM;
+
+	shadow = kcalloc(nslots, sizeof(struct video_fifoslot_s), GFP_KERNEL);
+	published = kmalloc(nslots * sizeof(struct video_fifoslot_s), GFP_KERNEL);
+	if (zerocopy || f->slotref)
+		slotref = kcalloc(nslots, sizeof(struct fifo_slotref_s), GFP_KERNEL);
+	if (shadow == NULL || published == NULL || ((zerocopy || f->slotref) && slotref == NULL)) {
+		kfree(slotref);
+		kfree(published);
+		kfree(shadow);
+		pci_free_consistent(f->em->pci_dev, nslots * slotsize, fifobuffer, phys_base);
+		return -ENOMEM;
+	}
+	/* Unknown, so that the first publish writes every word */
+	memset(published, 0xff, nslots * sizeof(struct video_fifoslot_s));
+
+	f->valid = 0;
+
+	spin_lock_irqsave(&f->slotref_lock, irqflags);
+	old_fifobuffer = f->fifobuffer;
+	old_phys_base = f->phys_base;
+	old_shadow = f->shadow;
+	old_published = f->published;
+	old_slotref = f->slotref;
+	old_nslots = f->nslots;
+	old_slotsize = f->slotsize;
+
+	f->fifobuffer = fifobuffer;
+	f->phys_base = phys_base;
+	f->shadow = shadow;
+	f->published = published;
+	f->slotref = slotref;
+	f->nslots = nslots;
+	f->slotsize = slotsize;
+	f->reclaimindex = 0;
+	spin_unlock_irqrestore(&f->slotref_lock, irqflags);
+
+	if (old_slotref)
+		em8300_fifo_put_slotref(f, old_slotref, old_nslots);
+	if (old_fifobuffer)
+		pci_free_consistent(f->em->pci_dev, old_nslots * old_slotsize, old_fifobuffer, old_phys_base);
+	kfree(old_shadow);
+	kfree(old_published);
+
+	f->threshold = threshold;
+	f->adaptive = adaptive;
+	f->drain_rate = 0;
+	f->drain_lasttime = ktime_set(0, 0);
+	f->bytes = 0;
+	f->committed = f->reclaimed = 0;
+	em8300_fifo_reset_stats(f);
+
+	if (f->ops->get_size(f) != f->nslots * f->slotptrsize) {
+		f->ops->set_size(f, f->nslots * f->slotptrsize);
+		if (em8300_fifo_writeindex(f) >= f->nslots) {
+			f->ops->set_readptr(f, f->start);
+			f->ops->set_writeptr(f, f->start);
+		}
+	}
+
+	for (i = 0; i < f->nslots; i++) {
+		f->shadow[i].flags = 0;
+		em8300_fifo_setaddr(f, i, f->phys_base + i * f->slotsize);
+		f->shadow[i].slotsize = f->slotsize;
+	}
+	f->ops->publish(f, 0, f->nslots);
+	if (f->slotref)
+		f->reclaimindex = em8300_fifo_readindex(f);
+
+	f->valid = 1;
+
+	return 0;
+}
+
+int em8300_fifo_init(struct em8300_s *em, struct fifo_s *f, int start, int wrptr, int rdptr, int pcisize,
+		     int nslots, int slotsize, int threshold)
+{
 	f->em = em;
 
 	f->writeptr = (unsigned *volatile) ucregister_ptr(wrptr);
@@ -40,35 +368,175 @@ int em8300_fifo_init(struct em8300_s *em, struct fifo_s *f, int start, int wrptr
 
 	f->slotptrsize = 4;
 	f->slots.v = (struct video_fifoslot_s *) ucregister_ptr(start);
-	f->nslots = read_ucregister(pcisize) / 4;
-
-	f->slotsize = slotsize;
 	f->start = ucregister(start) - 0x1000;
-	f->threshold = f->nslots / 2;
+	f->reg_pcisize = pcisize;
+	f->ops = &em8300_fifo_mmio_ops;
+	f->maxslots = f->ops->get_size(f) / f->slotptrsize;
 
-	f->bytes = 0;
+	return em8300_fifo_configure(f, nslots, slotsize, threshold);
+}
 
-	if (f->fifobuffer) {
-		kfree(f->fifobuffer);
+/*
+ * Change the geometry of an idle fifo. 0 keeps the current slot size.
+ */
+int em8300_fifo_set_geometry(struct fifo_s *f, int nslots, int slotsize, int threshold)
+{
+	int ret;
+
+	if (!f || !f->em)
+		return -EPERM;
+
+	mutex_lock(&f->lock);
+	if (f->valid && f->ops->get_writeptr(f) != f->ops->get_readptr(f)) {
+		mutex_unlock(&f->lock);
+		return -EBUSY;
 	}
+	ret = em8300_fifo_configure(f, nslots, slotsize ? slotsize : f->slotsize, threshold);
+	mutex_unlock(&f->lock);
 
-	f->fifobuffer = pci_alloc_consistent(f->em->pci_dev, f->nslots * f->slotsize, &f->phys_base);
-	if (f->fifobuffer == NULL) {
-		return -ENOMEM;
+	return ret;
+}
+
+int em8300_fifo_enable_zerocopy(struct fifo_s *f)
+{
+	if (!f->valid)
+		return -EPERM;
+
+	if (!f->slotref) {
+		f->slotref = kcalloc(f->nslots, sizeof(struct fifo_slotref_s), GFP_KERNEL);
+		if (f->slotref == NULL)
+			return -ENOMEM;
+		f->reclaimindex = em8300_fifo_readindex(f);
 	}
 
-	init_waitqueue_head(&f->wait);
+	f->zerocopy = 1;
 
-	for (i = 0; i < f->nslots; i++) {
-		phys = f->phys_base + i * f->slotsize;
-		writel(0, &f->slots.v[i].flags);
-		writel(phys >> 16, &f->slots.v[i].physaddress_hi);
-		writel(phys & 0xffff, &f->slots.v[i].physaddress_lo);
-		writel(f->slotsize, &f->slots.v[i].slotsize);
+	return 0;
+}
+
+/*
+ * Let the fifo be fed with em8300_fifo_write_dma only, from buffers that
+ * stay mapped for DMA until fifo->reclaimed shows the card has read them.
+ */
+int em8300_fifo_enable_dma(struct fifo_s *f)
+{
+	int ret = 0;
+
+	if (!f->valid)
+		return -EPERM;
+
+	mutex_lock(&f->lock);
+	if (f->mapped || f->staging_buffer) {
+		ret = -EBUSY;
+		goto out;
 	}
+	if (!f->slotref) {
+		f->slotref = kcalloc(f->nslots, sizeof(struct fifo_slotref_s), GFP_KERNEL);
+		if (f->slotref == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		f->reclaimindex = em8300_fifo_readindex(f);
+	}
+	f->streaming = 1;
+out:
+	mutex_unlock(&f->lock);
+	return ret;
+}
 
-	sema_init(&f->lock, 1);
-	f->valid = 1;
+/* Drop the queued data and point all the slots back to the bounce buffer */
+void em8300_fifo_disable_dma(struct fifo_s *f)
+{
+	unsigned long irqflags;
+	int i;
+
+	if (!f->valid)
+		return;
+
+	mutex_lock(&f->lock);
+	em8300_fifo_flush_nolock(f);
+	spin_lock_irqsave(&f->slotref_lock, irqflags);
+	for (i = 0; i < f->nslots; i++)
+		em8300_fifo_release_slot(f, i);
+	spin_unlock_irqrestore(&f->slotref_lock, irqflags);
+	f->streaming = 0;
+	mutex_unlock(&f->lock);
+
+	wake_up_interruptible(&f->wait);
+}
+
+/*
+ * Queue n bytes the card reads from the bus address dma on. Returns the
+ * number of bytes queued, which is less than n if the fifo is full.
+ */
+int em8300_fifo_write_dma(struct fifo_s *fifo, dma_addr_t dma, int n, int flags)
+{
+	unsigned long irqflags;
+	int freeslots, readindex, writeindex, i, size, bytes_transferred = 0;
+
+	mutex_lock(&fifo->lock);
+	if (!fifo->streaming) {
+		mutex_unlock(&fifo->lock);
+		return -EINVAL;
+	}
+
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	for (i = 0; i < freeslots && n; i++) {
+		int index = (writeindex + i) % fifo->nslots;
+
+		size = min(n, fifo->slotsize);
+
+		spin_lock_irqsave(&fifo->slotref_lock, irqflags);
+		em8300_fifo_release_slot(fifo, index);
+		fifo->slotref[index].dma = dma;
+		fifo->slotref[index].size = size;
+		spin_unlock_irqrestore(&fifo->slotref_lock, irqflags);
+
+		fifo->shadow[index].flags = flags;
+		em8300_fifo_setaddr(fifo, index, dma);
+		fifo->shadow[index].slotsize = size;
+
+		n -= size;
+		dma += size;
+		bytes_transferred += size;
+		fifo->bytes += size;
+	}
+	em8300_fifo_commit(fifo, writeindex, i);
+	mutex_unlock(&fifo->lock);
+
+	return bytes_transferred;
+}
+
+/*
+ * Put a staging ring of size bytes (rounded down to a power of two) in front
+ * of the slots. Writes then return as soon as the data is in the ring.
+ */
+int em8300_fifo_enable_staging(struct fifo_s *f, int size)
+{
+	void *buffer;
+
+	if (!f->valid)
+		return -EPERM;
+	if (f->staging_buffer)
+		return -EBUSY;
+	if (size < PAGE_SIZE)
+		return -EINVAL;
+
+	size = rounddown_pow_of_two(size);
+	buffer = vmalloc(size);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&f->lock);
+	kfifo_init(&f->staging, buffer, size);
+	f->staged_in = f->staged_out = 0;
+	f->staged_flags = f->staging_flags = 0;
+	f->staging_buffer = buffer;
+	mutex_unlock(&f->lock);
 
 	return 0;
 }
@@ -76,9 +544,10 @@ int em8300_fifo_init(struct em8300_s *em, struct fifo_s *f, int start, int wrptr
 void em8300_fifo_free(struct fifo_s *f)
 {
 	if (f) {
-		if (f->valid && f->fifobuffer) {
-			pci_free_consistent(f->em->pci_dev, f->nslots * f->slotsize, f->fifobuffer, f->phys_base);
-		}
+		cancel_work_sync(&f->refill_work);
+		if (f->em)
+			em8300_fifo_release(f);
+		vfree(f->staging_buffer);
 		kfree(f);
 	}
 }
@@ -86,30 +555,109 @@ void em8300_fifo_free(struct fifo_s *f)
 struct fifo_s *em8300_fifo_alloc()
 {
 	struct fifo_s *f = kzalloc(sizeof(struct fifo_s), GFP_KERNEL);
+
+	if (f) {
+		init_waitqueue_head(&f->wait);
+		mutex_init(&f->lock);
+		spin_lock_init(&f->slotref_lock);
+		INIT_KFIFO(f->marks);
+		INIT_WORK(&f->refill_work, em8300_fifo_refill_work);
+	}
+
 	return f;
 }
 
+/*
+ * Estimate how many slots the card drains per second, and set the wakeup
+ * threshold so that a woken writer still has EM8300_FIFO_ADAPTIVE_LATENCY_MS
+ * worth of queued slots in front of it.
+ */
+static void em8300_fifo_adapt(struct fifo_s *fifo, int readindex, int queued)
+{
+	ktime_t now = ktime_get();
+	s64 us = ktime_us_delta(now, fifo->drain_lasttime);
+	int drained = (readindex - fifo->drain_lastindex + fifo->nslots) % fifo->nslots;
+	int rate, reserve, threshold;
+
+	/*
+	 * Skip the samples taken after a pause, and those where the card ran
+	 * out of data, as they underestimate the rate.
+	 */
+	if (us > 0 && us < USEC_PER_SEC && queued) {
+		rate = drained * USEC_PER_SEC / (unsigned long)us;
+		if (fifo->drain_rate)
+			fifo->drain_rate += (rate - fifo->drain_rate) / 4;
+		else
+			fifo->drain_rate = rate;
+
+		reserve = fifo->drain_rate * EM8300_FIFO_ADAPTIVE_LATENCY_MS / 1000 + 1;
+		threshold = fifo->nslots - 1 - reserve;
+		fifo->threshold = threshold < 1 ? 1 : threshold;
+	}
+
+	fifo->drain_lastindex = readindex;
+	fifo->drain_lasttime = now;
+}
+
 int em8300_fifo_check(struct fifo_s *fifo)
 {
-	int freeslots;
+	int freeslots, readindex, writeindex;
 
 	if (!fifo || !fifo->valid) {
 		return -1;
 	}
 
-	freeslots = em8300_fifo_freeslots(fifo);
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+
+	if (fifo->adaptive)
+		em8300_fifo_adapt(fifo, readindex, fifo->nslots - 1 - freeslots);
+
+	if (fifo->nslots - 1 - freeslots < fifo->stats.low_occupancy)
+		fifo->stats.low_occupancy = fifo->nslots - 1 - freeslots;
+	if (fifo->nslots - 1 - freeslots > fifo->stats.high_occupancy)
+		fifo->stats.high_occupancy = fifo->nslots - 1 - freeslots;
 
 	if (freeslots > fifo->threshold) {
-		wake_up_interruptible(&fifo->wait);
+		if (fifo->staging_buffer && fifo->staged_in != fifo->staged_out)
+			schedule_work(&fifo->refill_work);
+		else
+			wake_up_interruptible(&fifo->wait);
 	}
 
 	return 0;
 }
 
+/*
+ * Reclaim the slots the card has read, without the accounting done by
+ * em8300_fifo_check. This lets the VBL interrupt keep fifo->reclaimed
+ * moving while the fifo interrupt is not raised.
+ */
+void em8300_fifo_poll(struct fifo_s *fifo)
+{
+	if (!fifo || !fifo->valid || !fifo->slotref)
+		return;
+
+	em8300_fifo_reclaim(fifo, em8300_fifo_readindex(fifo));
+}
+
+/* Whether the card has read all the data written, staged data included */
+int em8300_fifo_empty(struct fifo_s *fifo)
+{
+	return fifo->staged_in == fifo->staged_out &&
+		fifo->ops->get_writeptr(fifo) == fifo->ops->get_readptr(fifo);
+}
+
 int em8300_fifo_sync(struct fifo_s *fifo)
 {
 	long ret;
-	ret = wait_event_interruptible_timeout(fifo->wait, readl(fifo->writeptr) == readl(fifo->readptr), 3 * HZ);
+	if (fifo->staging_buffer)
+		schedule_work(&fifo->refill_work);
+	ret = wait_event_interruptible_timeout(fifo->wait, em8300_fifo_empty(fifo), 3 * HZ);
 	if (ret == 0) {
 		printk(KERN_ERR "em8300-%d: FIFO sync timeout during sync\n", fifo->em->instance);
 		return -EINTR;
@@ -119,65 +667,335 @@ int em8300_fifo_sync(struct fifo_s *fifo)
 		return ret;
 }
 
-int em8300_fifo_write_nolock(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+/*
+ * Let the card read the data straight from the user pages: each slot is
+ * pointed to (part of) a pinned user page instead of the bounce buffer.
+ * The pages are released by em8300_fifo_reclaim, from the fifo and VBL
+ * interrupts, once the card has read them. The write does not wait for
+ * that: the fifo holds at most nslots - 1 slots, so a buffer is read by the
+ * time that much more data has been written after it.
+ */
+static int em8300_fifo_write_zerocopy_nolock(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
 {
-	int freeslots, writeindex, i, bytes_transferred = 0, copysize;
+	struct pci_dev *pci_dev = fifo->em->pci_dev;
+	unsigned long uaddr = (unsigned long)userbuffer;
+	unsigned long irqflags;
+	int freeslots, readindex, writeindex, i, bytes_transferred = 0;
 
-	if (!fifo || !fifo->valid) {
-		return -1;
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	for (i = 0; i < freeslots && n; i++) {
+		int index = (writeindex + i) % fifo->nslots;
+		unsigned int offset = uaddr & ~PAGE_MASK;
+		int size = min_t(int, n, min_t(int, PAGE_SIZE - offset, fifo->slotsize));
+		struct page *page;
+		dma_addr_t dma;
+
+		if (get_user_pages_fast(uaddr & PAGE_MASK, 1, 0, &page) != 1)
+			break;
+
+		dma = pci_map_page(pci_dev, page, offset, size, PCI_DMA_TODEVICE);
+		if (pci_dma_mapping_error(pci_dev, dma)) {
+			put_page(page);
+			break;
+		}
+
+		/* the slot may still hold a page if the fifo was flushed */
+		spin_lock_irqsave(&fifo->slotref_lock, irqflags);
+		em8300_fifo_release_slot(fifo, index);
+		fifo->slotref[index].page = page;
+		fifo->slotref[index].dma = dma;
+		fifo->slotref[index].size = size;
+		spin_unlock_irqrestore(&fifo->slotref_lock, irqflags);
+
+		fifo->shadow[index].flags = flags;
+		em8300_fifo_setaddr(fifo, index, dma);
+		fifo->shadow[index].slotsize = size;
+
+		n -= size;
+		uaddr += size;
+		bytes_transferred += size;
+		fifo->bytes += size;
 	}
+	em8300_fifo_commit(fifo, writeindex, i);
+
+	if (i < freeslots && n && !bytes_transferred)
+		return -EFAULT;
+
+	return bytes_transferred;
+}
+
+/*
+ * Copy up to n bytes to the freeslots slots following writeindex, without
+ * making them visible to the card. Sets *filled to the number of slots
+ * used and returns the number of bytes copied.
+ */
+static int em8300_fifo_fill(struct fifo_s *fifo, int writeindex, int freeslots, int n,
+			    const char *userbuffer, int flags, int *filled)
+{
+	int i, bytes_transferred = 0, copysize;
 
-	writeindex = ((int)readl(fifo->writeptr) - fifo->start) / fifo->slotptrsize;
-	freeslots = em8300_fifo_freeslots(fifo);
 	for (i = 0; i < freeslots && n; i++) {
+		int index = (writeindex + i) % fifo->nslots;
+
 		copysize = n < fifo->slotsize ? n : fifo->slotsize;
 
-		writel(flags, &fifo->slots.v[writeindex].flags);
-		writel(copysize, &fifo->slots.v[writeindex].slotsize);
-		break;
+		if (fifo->slotref) {
+			unsigned long irqflags;
 
+			spin_lock_irqsave(&fifo->slotref_lock, irqflags);
+			em8300_fifo_release_slot(fifo, index);
+			spin_unlock_irqrestore(&fifo->slotref_lock, irqflags);
+		}
 
-		if (!access_ok(VERIFY_READ, userbuffer, copysize))
-			return -EFAULT;
+		if (copy_from_user(fifo->fifobuffer + index * fifo->slotsize, userbuffer, copysize)) {
+			if (!bytes_transferred)
+				bytes_transferred = -EFAULT;
+			break;
+		}
 
-		(void)copy_from_user(fifo->fifobuffer + writeindex * fifo->slotsize, userbuffer, copysize);
+		fifo->shadow[index].flags = flags;
+		em8300_fifo_setaddr(fifo, index, fifo->phys_base + index * fifo->slotsize);
+		fifo->shadow[index].slotsize = copysize;
 
-		writeindex++;
-		writeindex %= fifo->nslots;
 		n -= copysize;
 		userbuffer += copysize;
 		bytes_transferred += copysize;
 		fifo->bytes += copysize;
 	}
-	writel(fifo->start + writeindex * fifo->slotptrsize, fifo->writeptr);
+	*filled = i;
 
 	return bytes_transferred;
 }
 
+int em8300_fifo_write_nolock(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+{
+	int freeslots, readindex, writeindex, filled, bytes_transferred;
+
+	if (!fifo || !fifo->valid) {
+		return -1;
+	}
+
+	if (fifo->mapped || fifo->streaming)
+		return -EBUSY;
+
+	if (fifo->zerocopy && n >= EM8300_FIFO_ZEROCOPY_MIN &&
+	    !((unsigned long)userbuffer & 3))
+		return em8300_fifo_write_zerocopy_nolock(fifo, n, userbuffer, flags);
+
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	bytes_transferred = em8300_fifo_fill(fifo, writeindex, freeslots, n, userbuffer, flags, &filled);
+	em8300_fifo_commit(fifo, writeindex, filled);
+
+	return bytes_transferred;
+}
+
+/*
+ * Move as much staged data as there are free slots from the staging ring to
+ * the bounce buffer. A slot never spans a change of flags, so the flags of
+ * each write stay with its data. Must be called with fifo->lock held.
+ */
+static void em8300_fifo_refill(struct fifo_s *fifo)
+{
+	int freeslots, readindex, writeindex, i;
+	unsigned int moved = 0;
+
+	if (!fifo->valid)
+		return;
+
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	for (i = 0; i < freeslots; i++) {
+		int index = (writeindex + i) % fifo->nslots;
+		unsigned int size = fifo->staged_in - fifo->staged_out;
+		struct fifo_mark_s mark;
+
+		while (kfifo_peek(&fifo->marks, &mark) && mark.pos == fifo->staged_out) {
+			fifo->staging_flags = mark.flags;
+			kfifo_skip(&fifo->marks);
+		}
+		if (kfifo_peek(&fifo->marks, &mark) && mark.pos - fifo->staged_out < size)
+			size = mark.pos - fifo->staged_out;
+		if (size > fifo->slotsize)
+			size = fifo->slotsize;
+		if (!size)
+			break;
+
+		if (fifo->slotref) {
+			unsigned long irqflags;
+
+			spin_lock_irqsave(&fifo->slotref_lock, irqflags);
+			em8300_fifo_release_slot(fifo, index);
+			spin_unlock_irqrestore(&fifo->slotref_lock, irqflags);
+		}
+
+		size = kfifo_out(&fifo->staging, fifo->fifobuffer + index * fifo->slotsize, size);
+
+		fifo->shadow[index].flags = fifo->staging_flags;
+		em8300_fifo_setaddr(fifo, index, fifo->phys_base + index * fifo->slotsize);
+		fifo->shadow[index].slotsize = size;
+
+		fifo->staged_out += size;
+		fifo->bytes += size;
+		moved += size;
+	}
+	em8300_fifo_commit(fifo, writeindex, i);
+
+	if (moved)
+		wake_up_interruptible(&fifo->wait);
+}
+
+static void em8300_fifo_refill_work(struct work_struct *work)
+{
+	struct fifo_s *fifo = container_of(work, struct fifo_s, refill_work);
+
+	mutex_lock(&fifo->lock);
+	em8300_fifo_refill(fifo);
+	mutex_unlock(&fifo->lock);
+}
+
+/*
+ * Append to the staging ring and push what fits to the slots. Returns the
+ * number of bytes taken, 0 if the ring is full. Must be called with
+ * fifo->lock held.
+ */
+static int em8300_fifo_stage_nolock(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+{
+	unsigned int copied;
+
+	if (!fifo->valid)
+		return -1;
+	if (fifo->mapped || fifo->streaming)
+		return -EBUSY;
+
+	if (n > kfifo_avail(&fifo->staging))
+		n = kfifo_avail(&fifo->staging);
+	if (!n)
+		return 0;
+
+	if (flags != fifo->staged_flags) {
+		struct fifo_mark_s mark = { fifo->staged_in, flags };
+
+		if (!kfifo_put(&fifo->marks, &mark))
+			return 0;
+		fifo->staged_flags = flags;
+	}
+
+	if (kfifo_from_user(&fifo->staging, userbuffer, n, &copied) && !copied)
+		return -EFAULT;
+	fifo->staged_in += copied;
+
+	em8300_fifo_refill(fifo);
+
+	return copied;
+}
+
 int em8300_fifo_write(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
 {
 	int ret;
-	down(&fifo->lock);
-	ret = em8300_fifo_write_nolock(fifo, n, userbuffer, flags);
-	up(&fifo->lock);
+
+	if (mutex_lock_interruptible(&fifo->lock))
+		return -ERESTARTSYS;
+	if (fifo->staging_buffer)
+		ret = em8300_fifo_stage_nolock(fifo, n, userbuffer, flags);
+	else
+		ret = em8300_fifo_write_nolock(fifo, n, userbuffer, flags);
+	mutex_unlock(&fifo->lock);
+
 	return ret;
 }
 
-int em8300_fifo_writeblocking_nolock(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+/*
+ * Wait until the fifo has a free slot. This is called without the fifo lock
+ * held, so that a flush or another writer never has to wait for us.
+ */
+static int em8300_fifo_do_wait(struct fifo_s *fifo)
 {
-	int total_bytes_written = 0, copy_size;
+	struct em8300_s *em = fifo->em;
+	struct em8300_stall_s stall;
 	long ret;
 
+	if (fifo->staging_buffer)
+		return wait_event_interruptible(fifo->wait, (!kfifo_is_full(&fifo->staging) && !kfifo_is_full(&fifo->marks)) || !fifo->valid);
+
+	/*
+	 * While the fifo stays full, make sure the decoder is still making
+	 * progress, and recover it if it is stuck.
+	 */
+	em8300_video_stall_start(em, &stall, fifo);
+	for (;;) {
+		ret = wait_event_interruptible_timeout(fifo->wait, em8300_fifo_freeslots(fifo), EM8300_FIFO_STALL_TIMEOUT);
+		if (ret > 0)
+			return 0;
+		if (ret < 0)
+			return ret;
+
+		switch (em8300_video_stall_check(em, &stall)) {
+		case EM8300_STALL_RESTART:
+			fifo->stats.restarts++;
+			break;
+		case -1:
+			printk(KERN_ERR "em8300-%d: FIFO sync timeout during blocking write\n", em->instance);
+			return -EINTR;
+		}
+	}
+}
+
+static int em8300_fifo_wait(struct fifo_s *fifo)
+{
+	ktime_t start = ktime_get();
+	s64 us;
+	int ret, bucket;
+
+	fifo->stats.high_occupancy = fifo->nslots - 1;
+
+	ret = em8300_fifo_do_wait(fifo);
+
+	us = ktime_us_delta(ktime_get(), start);
+	bucket = us > 1 ? ilog2(us) : 0;
+	if (bucket >= EM8300_FIFO_WAIT_BUCKETS)
+		bucket = EM8300_FIFO_WAIT_BUCKETS - 1;
+
+	fifo->stats.waits++;
+	fifo->stats.wait_us += us;
+	fifo->stats.wait_hist[bucket]++;
+
+	return ret;
+}
+
+int em8300_fifo_writeblocking(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+{
+	int total_bytes_written = 0, copy_size;
+	int ret;
+
 	if (!fifo->valid) {
 		return -EPERM;
 	}
 
-
 	while (n) {
-		copy_size = em8300_fifo_write_nolock(fifo, n, userbuffer, flags);
+		if (mutex_lock_interruptible(&fifo->lock))
+			return (total_bytes_written>0) ? total_bytes_written : -ERESTARTSYS;
+		if (fifo->staging_buffer)
+			copy_size = em8300_fifo_stage_nolock(fifo, n, userbuffer, flags);
+		else
+			copy_size = em8300_fifo_write_nolock(fifo, n, userbuffer, flags);
+		mutex_unlock(&fifo->lock);
 
 		if (copy_size == -EFAULT)
-			return -EFAULT;
+			return (total_bytes_written>0) ? total_bytes_written : -EFAULT;
+
+		if (copy_size == -EBUSY)
+			return (total_bytes_written>0) ? total_bytes_written : -EBUSY;
 
 		if (copy_size < 0) {
 			return -EIO;
@@ -188,63 +1006,324 @@ int em8300_fifo_writeblocking_nolock(struct fifo_s *fifo, int n, const char *use
 		total_bytes_written += copy_size;
 
 		if (!copy_size) {
-			struct em8300_s *em = fifo->em;
-			int running = 1;
-
-			//printk("em8300-%d: Fifo Full %p\n", em->instance, fifo);
-
-			running = (running && (read_ucregister(MV_SCRSpeed) > 0));
-			running = (running && (em->video_playmode == EM8300_PLAYMODE_PLAY));
-			/* FIXME: are these all conditions for a running DMA engine? */
-
-			if (running) {
-				int i;
-				for (i = 0; i < 2; i++) {
-
-					ret = wait_event_interruptible_timeout(fifo->wait, em8300_fifo_freeslots(fifo), 2 * HZ);
-					if (ret > 0)
-						break;
-					else if (ret == 0) {
-						printk("em8300-%d: Fifo still full, trying stop\n", fifo->em->instance);
-						em8300_video_setplaymode(em, EM8300_PLAYMODE_STOPPED);
-						em8300_video_setplaymode(em, EM8300_PLAYMODE_PLAY);
-					} else
-						return (total_bytes_written>0) ? total_bytes_written : ret;
-				}
-				if (ret == 0) {
-					printk(KERN_ERR "em8300-%d: FIFO sync timeout during blocking write\n", fifo->em->instance);
-					return (total_bytes_written>0)?total_bytes_written:-EINTR;
-				}
-			} else {
-				if ((ret = wait_event_interruptible(fifo->wait, em8300_fifo_freeslots(fifo))))
-					return (total_bytes_written>0) ? total_bytes_written : ret;
-			}
-
+			ret = em8300_fifo_wait(fifo);
+			if (ret)
+				return (total_bytes_written>0) ? total_bytes_written : ret;
 		}
 	}
 
-	// printk(KERN_ERR "em8300-%d: count = %d\n", em->instance, total_bytes_written);
-	// printk(KERN_ERR "em8300-%d: time  = %d\n", em->instance, jiffies - safe_jiff);
 	return total_bytes_written;
 }
 
-int em8300_fifo_writeblocking(struct fifo_s *fifo, int n, const char *userbuffer, int flags)
+/*
+ * Write a batch of packets, each with its own slot flags. The slots of
+ * consecutive packets are made visible to the card together, with a single
+ * commit, unless the fifo fills up in between. Unless nonblock is set, wait
+ * for free slots until all the packets are written. Returns the number of
+ * bytes written.
+ */
+int em8300_fifo_writev(struct fifo_s *fifo, const struct fifo_iovec_s *iov, int count, int nonblock)
+{
+	int readindex = 0, writeindex = 0, freeslots = 0, filled, queued = 0;
+	int total = 0, offset = 0, n, ret = 0;
+
+	if (!fifo->valid)
+		return -EPERM;
+
+	if (mutex_lock_interruptible(&fifo->lock))
+		return -ERESTARTSYS;
+	if (fifo->mapped || fifo->streaming) {
+		mutex_unlock(&fifo->lock);
+		return -EBUSY;
+	}
+
+	if (!fifo->staging_buffer) {
+		readindex = em8300_fifo_readindex(fifo);
+		writeindex = em8300_fifo_writeindex(fifo);
+		em8300_fifo_reclaim(fifo, readindex);
+		freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	}
+
+	while (count) {
+		if (offset == iov->size) {
+			iov++;
+			count--;
+			offset = 0;
+			continue;
+		}
+
+		if (fifo->staging_buffer) {
+			n = em8300_fifo_stage_nolock(fifo, iov->size - offset, iov->data + offset, iov->flags);
+		} else {
+			n = em8300_fifo_fill(fifo, (writeindex + queued) % fifo->nslots, freeslots - queued,
+					     iov->size - offset, iov->data + offset, iov->flags, &filled);
+			queued += filled;
+		}
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		offset += n;
+		total += n;
+
+		if (offset < iov->size) {
+			/* Out of room: let the card have what we have so far */
+			em8300_fifo_commit(fifo, writeindex, queued);
+			queued = 0;
+			if (nonblock)
+				break;
+
+			mutex_unlock(&fifo->lock);
+			ret = em8300_fifo_wait(fifo);
+			if (ret)
+				return total ? total : ret;
+			if (mutex_lock_interruptible(&fifo->lock))
+				return total ? total : -ERESTARTSYS;
+
+			if (!fifo->staging_buffer) {
+				readindex = em8300_fifo_readindex(fifo);
+				writeindex = em8300_fifo_writeindex(fifo);
+				em8300_fifo_reclaim(fifo, readindex);
+				freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+			}
+		}
+	}
+	em8300_fifo_commit(fifo, writeindex, queued);
+	mutex_unlock(&fifo->lock);
+
+	return total ? total : ret;
+}
+
+/*
+ * Drop everything that is queued in the fifo but not yet read by the card.
+ * The caller holds fifo->lock and wakes up the writers.
+ */
+void em8300_fifo_flush_nolock(struct fifo_s *fifo)
+{
+	int readptr = fifo->ops->get_readptr(fifo);
+	int readindex = em8300_fifo_ptr2index(fifo, readptr);
+
+	/* The dropped slots will never be read */
+	em8300_fifo_reclaim(fifo, readindex);
+	fifo->committed -= fifo->nslots - 1 -
+		em8300_fifo_ring_free(fifo, readindex, em8300_fifo_writeindex(fifo));
+
+	if (fifo->staging_buffer) {
+		kfifo_reset(&fifo->staging);
+		kfifo_reset(&fifo->marks);
+		fifo->staged_in = fifo->staged_out = 0;
+		fifo->staged_flags = fifo->staging_flags = 0;
+	}
+	fifo->ops->set_writeptr(fifo, readptr);
+}
+
+void em8300_fifo_flush(struct fifo_s *fifo)
+{
+	if (!fifo || !fifo->valid)
+		return;
+
+	mutex_lock(&fifo->lock);
+	em8300_fifo_flush_nolock(fifo);
+	mutex_unlock(&fifo->lock);
+
+	wake_up_interruptible(&fifo->wait);
+}
+
+static void em8300_fifo_vm_open(struct vm_area_struct *vma)
+{
+	struct fifo_s *fifo = vma->vm_private_data;
+
+	mutex_lock(&fifo->lock);
+	fifo->mapped++;
+	mutex_unlock(&fifo->lock);
+}
+
+static void em8300_fifo_vm_close(struct vm_area_struct *vma)
+{
+	struct fifo_s *fifo = vma->vm_private_data;
+
+	mutex_lock(&fifo->lock);
+	fifo->mapped--;
+	mutex_unlock(&fifo->lock);
+}
+
+static const struct vm_operations_struct em8300_fifo_vm_ops = {
+	.open = em8300_fifo_vm_open,
+	.close = em8300_fifo_vm_close,
+};
+
+/*
+ * Map the bounce buffer to userspace. While it is mapped, the fifo is fed
+ * with em8300_fifo_commit_mapped only: userspace writes the data at the
+ * head of the byte ring and commits it, and the slots are pointed at it
+ * without any copy.
+ */
+int em8300_fifo_mmap(struct fifo_s *fifo, struct vm_area_struct *vma)
 {
+	unsigned long size = vma->vm_end - vma->vm_start;
 	int ret;
-	down(&fifo->lock);
-	ret = em8300_fifo_writeblocking_nolock(fifo, n, userbuffer, flags);
-	up(&fifo->lock);
+
+	if (!fifo->valid)
+		return -EPERM;
+	if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (size > PAGE_ALIGN(fifo->nslots * fifo->slotsize))
+		return -EINVAL;
+
+	mutex_lock(&fifo->lock);
+	if (fifo->staging_buffer || fifo->streaming) {
+		ret = -EBUSY;
+		goto out;
+	}
+	if (!fifo->mapped && fifo->ops->get_writeptr(fifo) != fifo->ops->get_readptr(fifo)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(fifo->fifobuffer) >> PAGE_SHIFT,
+			      size, vma->vm_page_prot);
+	if (ret)
+		goto out;
+
+	if (!fifo->mapped)
+		fifo->maphead = 0;
+	fifo->mapped++;
+	vma->vm_ops = &em8300_fifo_vm_ops;
+	vma->vm_private_data = fifo;
+
+out:
+	mutex_unlock(&fifo->lock);
 	return ret;
 }
 
+/*
+ * Find the end of the free space of the mapped ring: the start of the
+ * oldest slot the card has not read yet, or the head if there is none.
+ * Must be called with fifo->lock held.
+ */
+static unsigned int em8300_fifo_mapped_tail(struct fifo_s *fifo)
+{
+	int readindex = em8300_fifo_readindex(fifo);
+	int writeindex = em8300_fifo_writeindex(fifo);
+
+	if (readindex == writeindex)
+		return fifo->maphead;
+
+	return ((fifo->shadow[readindex].physaddress_hi << 16) |
+		fifo->shadow[readindex].physaddress_lo) - fifo->phys_base;
+}
+
+void em8300_fifo_mapped_position(struct fifo_s *fifo, unsigned int *head,
+				 unsigned int *tail, unsigned int *size)
+{
+	mutex_lock(&fifo->lock);
+	*head = fifo->maphead;
+	*tail = em8300_fifo_mapped_tail(fifo);
+	*size = fifo->nslots * fifo->slotsize;
+	mutex_unlock(&fifo->lock);
+}
+
+static int em8300_fifo_commit_mapped_nolock(struct fifo_s *fifo, int n, int flags)
+{
+	int freeslots, readindex, writeindex, i, committed = 0;
+	unsigned int size = fifo->nslots * fifo->slotsize;
+
+	readindex = em8300_fifo_readindex(fifo);
+	writeindex = em8300_fifo_writeindex(fifo);
+	em8300_fifo_reclaim(fifo, readindex);
+
+	freeslots = em8300_fifo_ring_free(fifo, readindex, writeindex);
+	for (i = 0; i < freeslots && n; i++) {
+		int index = (writeindex + i) % fifo->nslots;
+		int chunk = n < fifo->slotsize ? n : fifo->slotsize;
+
+		if (chunk > size - fifo->maphead)
+			chunk = size - fifo->maphead;
+
+		fifo->shadow[index].flags = flags;
+		em8300_fifo_setaddr(fifo, index, fifo->phys_base + fifo->maphead);
+		fifo->shadow[index].slotsize = chunk;
+
+		fifo->maphead = (fifo->maphead + chunk) % size;
+		n -= chunk;
+		committed += chunk;
+		fifo->bytes += chunk;
+	}
+	em8300_fifo_commit(fifo, writeindex, i);
+
+	return committed;
+}
+
+/*
+ * Queue n bytes that userspace wrote at the head of the mapped ring.
+ * Unless nonblock is set, wait for slots until all of them are queued.
+ * n must be a multiple of 4, so that the head, where the next slot starts,
+ * stays aligned as the card requires. Returns the number of bytes queued.
+ */
+int em8300_fifo_commit_mapped(struct fifo_s *fifo, int n, int flags, int nonblock)
+{
+	int total = 0, committed, ret;
+	unsigned int space, size;
+
+	if (!fifo->valid)
+		return -EPERM;
+
+	if (mutex_lock_interruptible(&fifo->lock))
+		return -ERESTARTSYS;
+	size = fifo->nslots * fifo->slotsize;
+	space = (em8300_fifo_mapped_tail(fifo) - fifo->maphead - 1 + size) % size;
+	ret = fifo->mapped ? 0 : -EINVAL;
+	mutex_unlock(&fifo->lock);
+
+	if (ret)
+		return ret;
+	if (n < 0 || n > space || (n & 3))
+		return -EINVAL;
+
+	while (n) {
+		if (mutex_lock_interruptible(&fifo->lock))
+			return total ? total : -ERESTARTSYS;
+		committed = em8300_fifo_commit_mapped_nolock(fifo, n, flags);
+		mutex_unlock(&fifo->lock);
+
+		n -= committed;
+		total += committed;
+
+		if (!committed) {
+			if (nonblock)
+				break;
+			ret = em8300_fifo_wait(fifo);
+			if (ret)
+				return total ? total : ret;
+		}
+	}
+
+	return total;
+}
+
 int em8300_fifo_freeslots(struct fifo_s *fifo)
 {
-	return (((int)readl(fifo->readptr) - (int)readl(fifo->writeptr)) / fifo->slotptrsize + fifo->nslots - 1) % fifo->nslots;
+	return em8300_fifo_ring_free(fifo, em8300_fifo_readindex(fifo), em8300_fifo_writeindex(fifo));
+}
+
+void em8300_fifo_reset_stats(struct fifo_s *fifo)
+{
+	memset(&fifo->stats, 0, sizeof(fifo->stats));
+	fifo->stats.low_occupancy = fifo->nslots - 1;
 }
 
 void em8300_fifo_statusmsg(struct fifo_s *fifo, char *str)
 {
 	int freeslots = em8300_fifo_freeslots(fifo);
-	sprintf(str, "Free slots: %d/%d", freeslots, fifo->nslots);
+
+	str += sprintf(str, "Free slots: %d/%d", freeslots, fifo->nslots);
+	if (fifo->adaptive)
+		str += sprintf(str, ", threshold: %d (adaptive, %d slots/s)",
+			       fifo->threshold, fifo->drain_rate);
+	else
+		str += sprintf(str, ", threshold: %d", fifo->threshold);
+	if (fifo->staging_buffer)
+		sprintf(str, ", staged: %u/%u", fifo->staged_in - fifo->staged_out,
+			kfifo_size(&fifo->staging));
 }
 
@@ -23,7 +23,11 @@
 #ifndef EM8300_FIFO_H
 #define EM8300_FIFO_H
 
-#include <linux/semaphore.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 struct video_fifoslot_s {
 	uint32_t flags;
@@ -39,14 +43,73 @@ struct pts_fifoslot_s {
 	uint32_t pts_lo;
 };
 
+/* One packet of a vectored write */
+struct fifo_iovec_s {
+	const char *data;
+	int size;
+	int flags;
+};
+
+/*
+ * A user page the card reads a slot from in zero-copy mode, or (page is
+ * NULL) a streaming buffer
+ */
+struct fifo_slotref_s {
+	struct page *page;
+	dma_addr_t dma;
+	int size;
+};
+
+/* Slot flags that apply to the staged data from stream position pos on */
+struct fifo_mark_s {
+	unsigned int pos;
+	int flags;
+};
+
+/* Blocked writes, by log2 of the time spent waiting in microseconds */
+#define EM8300_FIFO_WAIT_BUCKETS 24
+
+struct fifo_stats_s {
+	u64 bytes;
+	u64 slots;
+	int low_occupancy;	/* slots queued, as seen by the fifo interrupt */
+	int high_occupancy;
+	unsigned long waits;
+	u64 wait_us;
+	unsigned long restarts;
+	unsigned long wait_hist[EM8300_FIFO_WAIT_BUCKETS];
+};
+
 struct em8300_s;
+struct fifo_s;
+
+/*
+ * Access to the fifo state shared with the consumer: the read and write
+ * pointers, the size of the descriptor table and the descriptors
+ * themselves. The ring logic only goes through these. The driver only
+ * provides the MMIO ops talking to the card's microcode; another set,
+ * backed by plain memory and a simulated consumer, is what lets the ring
+ * logic run outside the kernel.
+ */
+struct fifo_ops_s {
+	int (*get_readptr)(struct fifo_s *fifo);
+	int (*get_writeptr)(struct fifo_s *fifo);
+	void (*set_readptr)(struct fifo_s *fifo, int ptr);
+	void (*set_writeptr)(struct fifo_s *fifo, int ptr);
+	int (*get_size)(struct fifo_s *fifo);
+	void (*set_size)(struct fifo_s *fifo, int size);
+	void (*publish)(struct fifo_s *fifo, int index, int count);
+};
 
 struct fifo_s {
 	struct em8300_s *em;
+	const struct fifo_ops_s *ops;
 
 	int valid;
 
 	int nslots;
+	int maxslots;
+	int reg_pcisize;
 	union {
 		struct video_fifoslot_s *v;
 		struct pts_fifoslot_s *pts;
@@ -60,36 +123,125 @@ struct fifo_s {
 	int localreadptr;
 	int threshold;
 
+	/* Adaptive threshold, from the rate the card drains the slots at */
+	int adaptive;
+	int drain_rate;		/* slots per second */
+	int drain_lastindex;
+	ktime_t drain_lasttime;
+
 	int bytes;
 
 	char *fifobuffer;
 
+	/* Host copy of the slot descriptors, published to the card in bursts */
+	struct video_fifoslot_s *shadow;
+	/* What the card holds, so that only changed words get written */
+	struct video_fifoslot_s *published;
+
 	wait_queue_head_t wait;
 
-	struct semaphore lock;
+	struct mutex lock;
 
 	dma_addr_t phys_base;
+
+	/* Zero-copy mode */
+	int zerocopy;
+	struct fifo_slotref_s *slotref;
+	int reclaimindex;
+	spinlock_t slotref_lock;
+
+	/* Fed from streaming buffers, which are done once reclaimed passes them */
+	int streaming;
+	u32 committed;		/* slots made visible to the card */
+	u32 reclaimed;		/* slots the card has read */
+
+	/* Staging ring, drained into the slots from the fifo interrupt */
+	void *staging_buffer;
+	struct kfifo staging;
+	DECLARE_KFIFO(marks, struct fifo_mark_s, 64);
+	unsigned int staged_in;
+	unsigned int staged_out;
+	int staged_flags;
+	int staging_flags;
+	struct work_struct refill_work;
+
+	/* Bounce buffer mapped by userspace, filled as a byte ring */
+	int mapped;
+	unsigned int maphead;
+
+	struct fifo_stats_s stats;
 };
 
 struct em8300_s;
+struct vm_area_struct;
+
+/*
+ * Ring arithmetic. A pointer is the register offset of a slot descriptor,
+ * an index is its position in the ring. One slot is always left empty, so
+ * that a full ring can be told from an empty one.
+ */
+static inline int em8300_fifo_ptr2index(const struct fifo_s *fifo, int ptr)
+{
+	return (ptr - fifo->start) / fifo->slotptrsize;
+}
+
+static inline int em8300_fifo_index2ptr(const struct fifo_s *fifo, int index)
+{
+	return fifo->start + (index % fifo->nslots) * fifo->slotptrsize;
+}
+
+static inline int em8300_fifo_ring_free(const struct fifo_s *fifo,
+					int readindex, int writeindex)
+{
+	return (readindex - writeindex + fifo->nslots - 1) % fifo->nslots;
+}
+
+static inline int em8300_fifo_readindex(struct fifo_s *fifo)
+{
+	return em8300_fifo_ptr2index(fifo, fifo->ops->get_readptr(fifo));
+}
+
+static inline int em8300_fifo_writeindex(struct fifo_s *fifo)
+{
+	return em8300_fifo_ptr2index(fifo, fifo->ops->get_writeptr(fifo));
+}
 
 /*
   Prototypes
 */
 int em8300_fifo_init(struct em8300_s *em, struct fifo_s *f,
 		     int start, int wrptr, int rdptr,
-		     int pcisize, int slotsize);
+		     int pcisize, int nslots, int slotsize, int threshold);
+int em8300_fifo_set_geometry(struct fifo_s *f, int nslots, int slotsize,
+			     int threshold);
 
 struct fifo_s * em8300_fifo_alloc(void);
 void em8300_fifo_free(struct fifo_s *f);
+int em8300_fifo_enable_zerocopy(struct fifo_s *f);
+int em8300_fifo_enable_staging(struct fifo_s *f, int size);
+int em8300_fifo_enable_dma(struct fifo_s *f);
+void em8300_fifo_disable_dma(struct fifo_s *f);
+int em8300_fifo_write_dma(struct fifo_s *fifo, dma_addr_t dma, int n, int flags);
 
 int em8300_fifo_write(struct fifo_s *fifo, int n, const char *userbuffer,
 		      int flags);
 int em8300_fifo_writeblocking(struct fifo_s *fifo, int n,
 			      const char *userbuffer, int flags);
+int em8300_fifo_writev(struct fifo_s *fifo, const struct fifo_iovec_s *iov,
+		       int count, int nonblock);
+void em8300_fifo_flush(struct fifo_s *fifo);
+void em8300_fifo_flush_nolock(struct fifo_s *fifo);
+int em8300_fifo_mmap(struct fifo_s *fifo, struct vm_area_struct *vma);
+int em8300_fifo_commit_mapped(struct fifo_s *fifo, int n, int flags,
+			      int nonblock);
+void em8300_fifo_mapped_position(struct fifo_s *fifo, unsigned int *head,
+				 unsigned int *tail, unsigned int *size);
 int em8300_fifo_check(struct fifo_s *fifo);
+void em8300_fifo_poll(struct fifo_s *fifo);
 int em8300_fifo_sync(struct fifo_s *fifo);
+int em8300_fifo_empty(struct fifo_s *fifo);
 int em8300_fifo_freeslots(struct fifo_s *fifo);
+void em8300_fifo_reset_stats(struct fifo_s *fifo);
 void em8300_fifo_statusmsg(struct fifo_s *fifo, char *str);
 
 #endif /* EM8300_FIFO_H */
@@ -184,8 +184,8 @@ int em8300_control_ioctl(struct em8300_s *em, int cmd, unsigned long arg)
 			get_user(val, (int *) arg);
 			val &= 0xFFFF;
 
-			write_ucregister(MV_SCRSpeed,
-			 read_ucregister(MicroCodeVersion) >= 0x29 ? val : val >> 8);
+			em8300_video_setspeed(em, val);
+			em8300_avsync_speed_changed(em);
 		}
 		if (_IOC_DIR(cmd) & _IOC_READ) {
 			val = read_ucregister(MV_SCRSpeed);
@@ -197,6 +197,26 @@ int em8300_control_ioctl(struct em8300_s *em, int cmd, unsigned long arg)
 		}
 	break;
 
+	case _IOC_NR(EM8300_IOCTL_AVSYNC):
+	{
+		em8300_avsync_t avsync;
+
+		if (copy_from_user(&avsync, (void *) arg, sizeof(em8300_avsync_t)))
+			return -EFAULT;
+		return em8300_avsync_set(em, &avsync);
+	}
+
+	case _IOC_NR(EM8300_IOCTL_DISCONTINUITY):
+	{
+		int usecs = em8300_video_discontinuity(em);
+
+		if (usecs < 0)
+			return usecs;
+		if (put_user(usecs, (unsigned *) arg))
+			return -EFAULT;
+		return 0;
+	}
+
 	case _IOC_NR(EM8300_IOCTL_FLUSH):
 
 		if (_IOC_DIR(cmd) & _IOC_WRITE) {
@@ -207,13 +227,51 @@ int em8300_control_ioctl(struct em8300_s *em, int cmd, unsigned long arg)
 			case EM8300_SUBDEVICE_VIDEO:
 				return em8300_video_flush(em);
 			case EM8300_SUBDEVICE_SUBPICTURE:
-				return -ENOSYS;
+				return em8300_spu_flush(em);
 			default:
 				return -EINVAL;
 			}
 		}
 	break;
 
+	case _IOC_NR(EM8300_IOCTL_GET_FIFO_GEOMETRY):
+	case _IOC_NR(EM8300_IOCTL_SET_FIFO_GEOMETRY):
+	{
+		em8300_fifo_geometry_t geometry;
+		struct fifo_s *fifo;
+
+		if (copy_from_user(&geometry, (void *) arg, sizeof(em8300_fifo_geometry_t)))
+			return -EFAULT;
+
+		switch (geometry.subdevice) {
+		case EM8300_SUBDEVICE_VIDEO:
+			fifo = em->mvfifo;
+			break;
+		case EM8300_SUBDEVICE_SUBPICTURE:
+			fifo = em->spfifo;
+			break;
+		default:
+			return -EINVAL;
+		}
+		if (!fifo)
+			return -ENODEV;
+
+		if (_IOC_NR(cmd) == _IOC_NR(EM8300_IOCTL_SET_FIFO_GEOMETRY)) {
+			if (em->video_playmode != EM8300_PLAYMODE_STOPPED)
+				return -EBUSY;
+			return em8300_fifo_set_geometry(fifo, geometry.nslots,
+							geometry.slotsize,
+							geometry.threshold);
+		}
+
+		geometry.nslots = fifo->nslots;
+		geometry.slotsize = fifo->slotsize;
+		geometry.threshold = fifo->adaptive ? -1 : fifo->threshold;
+		if (copy_to_user((void *) arg, &geometry, sizeof(em8300_fifo_geometry_t)))
+			return -EFAULT;
+	}
+	break;
+
 	default:
 		return -ETIME;
 	}
@@ -271,6 +329,15 @@ int em8300_ioctl_setplaymode(struct em8300_s *em, int mode)
 		//mpegaudio_command(em, MACOMMAND_PAUSE);
 		em8300_video_setplaymode(em, mode);
 		break;
+	case EM8300_PLAYMODE_SLOWFORWARDS:
+	case EM8300_PLAYMODE_SINGLESTEP:
+	case EM8300_PLAYMODE_SCAN:
+		if (em->playmode == EM8300_PLAYMODE_STOPPED) {
+			em8300_ioctl_enable_videoout(em, 1);
+		}
+		if (em8300_video_setplaymode(em, mode))
+			return -1;
+		break;
 	default:
 		return -1;
 	}
@@ -343,7 +410,8 @@ static int vidioc_querycap(struct file *file, void  *priv,
 	cap->version = 0;
 	cap->capabilities =
 			V4L2_CAP_VIDEO_OUTPUT |
-			V4L2_CAP_READWRITE;
+			V4L2_CAP_READWRITE |
+			V4L2_CAP_STREAMING;
 	return 0;
 }
 
@@ -366,6 +434,10 @@ static int vidioc_try_fmt_vid_out(struct file *file, void *priv,
 	if (f->fmt.pix.pixelformat != V4L2_PIX_FMT_MPEG)
 		return -EINVAL;
 
+	if (f->fmt.pix.sizeimage == 0)
+		f->fmt.pix.sizeimage = EM8300_VIDEO_BUFSIZE;
+	f->fmt.pix.sizeimage = PAGE_ALIGN(f->fmt.pix.sizeimage);
+
 	return 0;
 }
 
@@ -385,6 +457,7 @@ static int vidioc_g_fmt_vid_out(struct file *file, void *fh,
 				struct v4l2_format *f)
 {
 	f->fmt.pix.pixelformat = V4L2_PIX_FMT_MPEG;
+	f->fmt.pix.sizeimage = EM8300_VIDEO_BUFSIZE;
 
 	/* TODO: width, height */
 	return 0;
@@ -396,6 +469,16 @@ static const struct v4l2_ioctl_ops em8300_ioctl_ops = {
 	.vidioc_try_fmt_vid_out		= vidioc_try_fmt_vid_out,
 	.vidioc_s_fmt_vid_out  		= vidioc_s_fmt_vid_out,
 	.vidioc_g_fmt_vid_out		= vidioc_g_fmt_vid_out,
+	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
+	.vidioc_create_bufs		= vb2_ioctl_create_bufs,
+	.vidioc_querybuf		= vb2_ioctl_querybuf,
+	.vidioc_qbuf			= vb2_ioctl_qbuf,
+	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_expbuf			= vb2_ioctl_expbuf,
+	.vidioc_streamon		= vb2_ioctl_streamon,
+	.vidioc_streamoff		= vb2_ioctl_streamoff,
+	.vidioc_subscribe_event		= em8300_video_subscribe_event,
+	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
 };
 
 void em8300_set_funcs(struct video_device *vdev)
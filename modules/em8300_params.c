@@ -53,3 +53,39 @@ MODULE_PARM_DESC(card_model, "Model number for the em8300-based card. -1 (defaul
 int stop_video[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
 module_param_array(stop_video, int, NULL, 0444);
 MODULE_PARM_DESC(stop_video, "Set this to 1 if you want to stop video output instead of black when there is nothing to display. Defaults to 0.");
+
+int mvfifo_zerocopy[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(mvfifo_zerocopy, int, NULL, 0444);
+MODULE_PARM_DESC(mvfifo_zerocopy, "Set this to 1 to let the card read MPEG video data straight from the user buffers instead of copying it. Defaults to 0.");
+
+int mvfifo_staging_kb[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(mvfifo_staging_kb, int, NULL, 0444);
+MODULE_PARM_DESC(mvfifo_staging_kb, "Size in KiB of a kernel ring buffering MPEG video writes ahead of the FIFO, rounded down to a power of two. Defaults to 0 (no ring).");
+
+int mvfifo_slots[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(mvfifo_slots, int, NULL, 0444);
+MODULE_PARM_DESC(mvfifo_slots, "Number of slots of the MPEG video FIFO. Defaults to 0, which uses all the slots the microcode provides.");
+
+int mvfifo_slotsize[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0x900 };
+module_param_array(mvfifo_slotsize, int, NULL, 0444);
+MODULE_PARM_DESC(mvfifo_slotsize, "Size in bytes of each slot of the MPEG video FIFO. Defaults to 2304.");
+
+int mvfifo_threshold[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(mvfifo_threshold, int, NULL, 0444);
+MODULE_PARM_DESC(mvfifo_threshold, "Number of free slots of the MPEG video FIFO needed to wake up a blocked writer. Defaults to 0, which means half of the slots; -1 adapts it to the rate the card reads at.");
+
+int spfifo_slots[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(spfifo_slots, int, NULL, 0444);
+MODULE_PARM_DESC(spfifo_slots, "Number of slots of the sub-picture FIFO. Defaults to 0, which uses all the slots the microcode provides.");
+
+int spfifo_slotsize[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0x800 };
+module_param_array(spfifo_slotsize, int, NULL, 0444);
+MODULE_PARM_DESC(spfifo_slotsize, "Size in bytes of each slot of the sub-picture FIFO. Defaults to 2048.");
+
+int spfifo_threshold[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(spfifo_threshold, int, NULL, 0444);
+MODULE_PARM_DESC(spfifo_threshold, "Number of free slots of the sub-picture FIFO needed to wake up a blocked writer. Defaults to 0, which means half of the slots; -1 adapts it to the rate the card reads at.");
+
+int audio_rate_66[EM8300_MAX] = { [0 ... EM8300_MAX-1] = 0 };
+module_param_array(audio_rate_66, int, NULL, 0444);
+MODULE_PARM_DESC(audio_rate_66, "Set this to 1 to offer the 66 kHz audio rate of the clock generator, which not every DAC or receiver handles. Defaults to 0.");
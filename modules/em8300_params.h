@@ -35,4 +35,21 @@ extern int card_model[];
 /* Option to disable the video output when there is nothing to display */
 extern int stop_video[];
 
+/* Option to DMA video data straight from the user pages */
+extern int mvfifo_zerocopy[];
+
+/* Size of the staging ring in front of the video FIFO */
+extern int mvfifo_staging_kb[];
+
+/* FIFO geometry */
+extern int mvfifo_slots[];
+extern int mvfifo_slotsize[];
+extern int mvfifo_threshold[];
+extern int spfifo_slots[];
+extern int spfifo_slotsize[];
+extern int spfifo_threshold[];
+
+/* Option to offer the 66 kHz rate of the clock generator to ALSA */
+extern int audio_rate_66[];
+
 #endif /* _EM8300_PARAMS_H */
@@ -148,6 +148,27 @@ int em8300_spu_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg)
 	return 0;
 }
 
+/* Forget the sub-picture data and PTS the decoder has not used yet */
+void em8300_spu_drop(struct em8300_s *em)
+{
+	write_ucregister(SP_Wrptr_Lo, 0);
+	write_ucregister(SP_Wrptr_Hi, 0);
+	write_ucregister(SP_RdPtr_Lo, 0);
+	write_ucregister(SP_RdPtr_Hi, 0);
+
+	em->sp_ptsfifo_ptr = 0;
+	em->sp_ptsvalid = 0;
+	em->sp_pts = 0;
+}
+
+int em8300_spu_flush(struct em8300_s *em)
+{
+	em8300_spu_drop(em);
+	em8300_fifo_flush(em->spfifo);
+
+	return 0;
+}
+
 int em8300_spu_init(struct em8300_s *em)
 {
 	return 0;
@@ -28,6 +28,7 @@
 #include "em8300_driver.h"
 #include "em8300_reg.c"
 #include "em8300_fifo.h"
+#include "em8300_params.h"
 
 static int upload_block(struct em8300_s *em, int blocktype, int offset, int len, unsigned char *buf)
 {
@@ -199,9 +200,25 @@ int em8300_require_ucode(struct em8300_s *em)
 	if (!em->spfifo)
 		return 0;
 
-	em8300_fifo_init(em, em->mvfifo, MV_PCIStart, MV_PCIWrPtr, MV_PCIRdPtr, MV_PCISize, 0x900);
+	if (em8300_fifo_init(em, em->mvfifo, MV_PCIStart, MV_PCIWrPtr, MV_PCIRdPtr, MV_PCISize,
+			     mvfifo_slots[em->instance], mvfifo_slotsize[em->instance],
+			     mvfifo_threshold[em->instance])) {
+		printk(KERN_ERR "em8300-%d: unable to set up the video fifo\n", em->instance);
+		return 0;
+	}
+	if (mvfifo_zerocopy[em->instance])
+		if (em8300_fifo_enable_zerocopy(em->mvfifo))
+			printk(KERN_WARNING "em8300-%d: unable to enable zero-copy video writes\n", em->instance);
+	if (mvfifo_staging_kb[em->instance] > 0)
+		if (em8300_fifo_enable_staging(em->mvfifo, mvfifo_staging_kb[em->instance] * 1024))
+			printk(KERN_WARNING "em8300-%d: unable to allocate the video staging ring\n", em->instance);
 	/*	em8300_fifo_init(em,em->spfifo, SP_PCIStart, SP_PCIWrPtr, SP_PCIRdPtr, SP_PCISize, 0x1000, FIFOTYPE_VIDEO); */
-	em8300_fifo_init(em,em->spfifo, SP_PCIStart, SP_PCIWrPtr, SP_PCIRdPtr, SP_PCISize, 0x800);
+	if (em8300_fifo_init(em, em->spfifo, SP_PCIStart, SP_PCIWrPtr, SP_PCIRdPtr, SP_PCISize,
+			     spfifo_slots[em->instance], spfifo_slotsize[em->instance],
+			     spfifo_threshold[em->instance])) {
+		printk(KERN_ERR "em8300-%d: unable to set up the sub-picture fifo\n", em->instance);
+		return 0;
+	}
 	em8300_spu_init(em);
 
 	/*
@@ -0,0 +1,255 @@
+/*
+ * em8300_vb2.c -- V4L2 streaming output of MPEG video
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <media/videobuf2-dma-contig.h>
+
+#include "em8300_reg.h"
+#include <linux/em8300.h>
+#include "em8300_driver.h"
+#include "em8300_fifo.h"
+
+/*
+ * Output buffers are not copied: the slots of the video fifo are pointed
+ * straight at their bus address, from a work item as slots become free,
+ * and a buffer is given back once the card has read all of its slots.
+ * The timestamp of a buffer, if set, is used as the PTS of its data.
+ */
+
+struct em8300_vb2_buffer {
+	struct vb2_buffer vb;	/* must be first */
+	struct list_head list;
+	u32 end;		/* fifo->reclaimed once the card has read it */
+};
+
+static int em8300_vb2_queue_setup(struct vb2_queue *vq, const struct v4l2_format *fmt,
+				  unsigned int *nbuffers, unsigned int *nplanes,
+				  unsigned int sizes[], void *alloc_ctxs[])
+{
+	struct em8300_s *em = vb2_get_drv_priv(vq);
+	unsigned int size = EM8300_VIDEO_BUFSIZE;
+
+	if (fmt && fmt->fmt.pix.sizeimage)
+		size = fmt->fmt.pix.sizeimage;
+
+	if (*nbuffers < 2)
+		*nbuffers = 2;
+	*nplanes = 1;
+	sizes[0] = PAGE_ALIGN(size);
+	alloc_ctxs[0] = em->vb_alloc_ctx;
+
+	return 0;
+}
+
+static int em8300_vb2_buf_init(struct vb2_buffer *vb)
+{
+	struct em8300_vb2_buffer *buf = container_of(vb, struct em8300_vb2_buffer, vb);
+
+	INIT_LIST_HEAD(&buf->list);
+	return 0;
+}
+
+static void em8300_vb2_buf_queue(struct vb2_buffer *vb)
+{
+	struct em8300_s *em = vb2_get_drv_priv(vb->vb2_queue);
+	struct em8300_vb2_buffer *buf = container_of(vb, struct em8300_vb2_buffer, vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&em->vb_lock, flags);
+	list_add_tail(&buf->list, &em->vb_pending);
+	spin_unlock_irqrestore(&em->vb_lock, flags);
+
+	if (em->vb_streaming)
+		schedule_work(&em->vb_work);
+}
+
+static void em8300_vb2_cancel(struct em8300_s *em, enum vb2_buffer_state state)
+{
+	struct em8300_vb2_buffer *buf, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&em->vb_lock, flags);
+	list_splice_tail_init(&em->vb_pending, &em->vb_active);
+	list_for_each_entry_safe(buf, tmp, &em->vb_active, list) {
+		list_del_init(&buf->list);
+		if (state != VB2_BUF_STATE_QUEUED)
+			vb2_buffer_done(&buf->vb, state);
+	}
+	spin_unlock_irqrestore(&em->vb_lock, flags);
+}
+
+static int em8300_vb2_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct em8300_s *em = vb2_get_drv_priv(vq);
+	int ret;
+
+	ret = em8300_fifo_enable_dma(em->mvfifo);
+	if (ret) {
+		/* vb2 takes the buffers back by itself */
+		em8300_vb2_cancel(em, VB2_BUF_STATE_QUEUED);
+		return ret;
+	}
+
+	em->vb_fed = 0;
+	em->vb_pts_queued = 0;
+	em->vb_streaming = 1;
+
+	em8300_video_open(em);
+	em8300_ioctl_setplaymode(em, EM8300_PLAYMODE_PLAY);
+
+	schedule_work(&em->vb_work);
+
+	return 0;
+}
+
+static int em8300_vb2_stop_streaming(struct vb2_queue *vq)
+{
+	struct em8300_s *em = vb2_get_drv_priv(vq);
+
+	em->vb_streaming = 0;
+	cancel_work_sync(&em->vb_work);
+
+	em8300_ioctl_setplaymode(em, EM8300_PLAYMODE_STOPPED);
+	em8300_fifo_disable_dma(em->mvfifo);
+	em8300_video_flush(em);
+
+	em8300_vb2_cancel(em, VB2_BUF_STATE_ERROR);
+
+	return 0;
+}
+
+static const struct vb2_ops em8300_vb2_ops = {
+	.queue_setup		= em8300_vb2_queue_setup,
+	.buf_init		= em8300_vb2_buf_init,
+	.buf_queue		= em8300_vb2_buf_queue,
+	.start_streaming	= em8300_vb2_start_streaming,
+	.stop_streaming		= em8300_vb2_stop_streaming,
+	.wait_prepare		= vb2_ops_wait_prepare,
+	.wait_finish		= vb2_ops_wait_finish,
+};
+
+/*
+ * Feed the pending buffers to the fifo, as far as it has room. What does
+ * not fit is fed when the interrupt handler finds free slots again.
+ */
+static void em8300_vb2_feed(struct work_struct *work)
+{
+	struct em8300_s *em = container_of(work, struct em8300_s, vb_work);
+	struct em8300_vb2_buffer *buf;
+	struct timeval *tv;
+	unsigned long flags;
+	int size, ret, slotflags;
+
+	while (em->vb_streaming) {
+		spin_lock_irqsave(&em->vb_lock, flags);
+		buf = list_empty(&em->vb_pending) ? NULL :
+			list_first_entry(&em->vb_pending, struct em8300_vb2_buffer, list);
+		spin_unlock_irqrestore(&em->vb_lock, flags);
+		if (!buf)
+			break;
+
+		size = vb2_get_plane_payload(&buf->vb, 0);
+		tv = &buf->vb.v4l2_buf.timestamp;
+		slotflags = 0;
+
+		if (em->vb_fed == 0 && (tv->tv_sec || tv->tv_usec)) {
+			if (!em->vb_pts_queued) {
+				if (em8300_video_push_stream_pts(em, tv->tv_sec * 90000 + tv->tv_usec * 9 / 100))
+					break;
+				em->vb_pts_queued = 1;
+			}
+			slotflags = 0x40000000;
+		}
+
+		if (em->vb_fed < size) {
+			ret = em8300_fifo_write_dma(em->mvfifo,
+						    vb2_dma_contig_plane_dma_addr(&buf->vb, 0) + em->vb_fed,
+						    size - em->vb_fed, slotflags);
+			if (ret <= 0)
+				break;
+			em->video_offset += ret;
+			em->vb_fed += ret;
+			if (em->vb_fed < size)
+				break;
+		}
+
+		spin_lock_irqsave(&em->vb_lock, flags);
+		buf->end = em->mvfifo->committed;
+		list_move_tail(&buf->list, &em->vb_active);
+		spin_unlock_irqrestore(&em->vb_lock, flags);
+
+		em->vb_fed = 0;
+		em->vb_pts_queued = 0;
+	}
+}
+
+/* Called from the fifo and VBL interrupts */
+void em8300_vb2_irq(struct em8300_s *em)
+{
+	struct em8300_vb2_buffer *buf, *tmp;
+	int pending;
+
+	if (!em->vb_streaming)
+		return;
+
+	/* The interrupt handler has reclaimed the slots the card has read */
+	spin_lock(&em->vb_lock);
+	list_for_each_entry_safe(buf, tmp, &em->vb_active, list) {
+		if ((s32)(em->mvfifo->reclaimed - buf->end) < 0)
+			break;
+		list_del_init(&buf->list);
+		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+	}
+	pending = !list_empty(&em->vb_pending);
+	spin_unlock(&em->vb_lock);
+
+	if (pending && em8300_fifo_freeslots(em->mvfifo) > 0)
+		schedule_work(&em->vb_work);
+}
+
+int em8300_vb2_init(struct em8300_s *em)
+{
+	struct vb2_queue *q = &em->vb_queue;
+
+	spin_lock_init(&em->vb_lock);
+	INIT_LIST_HEAD(&em->vb_pending);
+	INIT_LIST_HEAD(&em->vb_active);
+	INIT_WORK(&em->vb_work, em8300_vb2_feed);
+
+	em->vb_alloc_ctx = vb2_dma_contig_init_ctx(&em->pci_dev->dev);
+	if (IS_ERR(em->vb_alloc_ctx))
+		return PTR_ERR(em->vb_alloc_ctx);
+
+	q->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	q->io_modes = VB2_MMAP | VB2_DMABUF;
+	q->drv_priv = em;
+	q->buf_struct_size = sizeof(struct em8300_vb2_buffer);
+	q->ops = &em8300_vb2_ops;
+	q->mem_ops = &vb2_dma_contig_memops;
+	/* Dropped by vb2_ops_wait_prepare while waiting for a buffer */
+	q->lock = &em->video_lock;
+
+	return vb2_queue_init(q);
+}
+
+void em8300_vb2_exit(struct em8300_s *em)
+{
+	vb2_dma_contig_cleanup_ctx(em->vb_alloc_ctx);
+}
@@ -29,6 +29,7 @@
 #include <linux/export.h>
 #include <linux/pci.h>
 #include <linux/delay.h>
+#include <asm/uaccess.h>
 
 #include "em8300_reg.h"
 #include <linux/em8300.h>
@@ -38,15 +39,91 @@
 
 #include <linux/soundcard.h>
 
-static int video_open(struct file *file)
+/* The fifo ring can be mapped as long as no streaming buffers exist */
+static int video_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	return 0;
+	struct em8300_s *em = video_drvdata(file);
+
+	if (em->vb_queue.num_buffers)
+		return vb2_fop_mmap(file, vma);
+
+	return em8300_fifo_mmap(em->mvfifo, vma);
+}
+
+/*
+ * The private ioctls of the former control and video devices take user
+ * pointers, so they are dispatched here rather than by video_ioctl2, which
+ * copies the argument in.
+ *
+ * vdev->lock is left unset, as the core would hold it around every ioctl:
+ * video_lock is taken here instead, around the V4L2 ioctls and the control
+ * ones. The video ones may block on the fifo and only take its lock, and so
+ * does EM8300_IOCTL_VBI, which waits for the next VBL.
+ */
+static long em8300_v4l2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct em8300_s *em = video_drvdata(file);
+	long ret;
+
+	if (_IOC_TYPE(cmd) == 'C') {
+		ret = em8300_video_ioctl(em, cmd, arg, file->f_flags & O_NONBLOCK);
+		if (ret != -ENOIOCTLCMD)
+			return ret;
+		if (cmd == EM8300_IOCTL_VBI)
+			return em8300_control_ioctl(em, cmd, arg);
+	}
+
+	if (mutex_lock_interruptible(&em->video_lock))
+		return -ERESTARTSYS;
+	if (_IOC_TYPE(cmd) == 'C')
+		ret = em8300_control_ioctl(em, cmd, arg);
+	else
+		ret = video_ioctl2(file, cmd, arg);
+	mutex_unlock(&em->video_lock);
+
+	return ret;
+}
+
+/* Plain writes of an MPEG video elementary stream, as with EM8300_IOCTL_VIDEO_WRITEV */
+static ssize_t em8300_v4l2_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct em8300_s *em = video_drvdata(file);
+
+	return em8300_video_write(em, buf, count, ppos, file->f_flags & O_NONBLOCK);
+}
+
+/*
+ * vb2_fop_poll reports POLLERR while the queue is not streaming, which
+ * would fail poll() for clients that only wait for events or use write()
+ */
+static unsigned int video_poll(struct file *file, poll_table *wait)
+{
+	struct em8300_s *em = video_drvdata(file);
+	struct v4l2_fh *fh = file->private_data;
+	unsigned int mask = 0;
+
+	if (vb2_is_streaming(&em->vb_queue))
+		return vb2_fop_poll(file, wait);
+
+	poll_wait(file, &fh->wait, wait);
+	if (v4l2_event_pending(fh))
+		mask |= POLLPRI;
+
+	poll_wait(file, &em->mvfifo->wait, wait);
+	if (em8300_fifo_freeslots(em->mvfifo) > 0)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
 }
 
 static struct v4l2_file_operations em8300_v4l2_fops = {
 	.owner      = THIS_MODULE,
-	.open		= video_open,
-	.ioctl      = video_ioctl2,
+	.open		= v4l2_fh_open,
+	.release	= vb2_fop_release,
+	.unlocked_ioctl = em8300_v4l2_ioctl,
+	.write		= em8300_v4l2_write,
+	.mmap		= video_mmap,
+	.poll		= video_poll,
 };
 
 static const struct video_device em8300_video_template = {
@@ -75,6 +152,17 @@ int em8300_register_video(struct em8300_s *em)
 	// register ioctl handler
 	em8300_set_funcs(em->vdev);
 
+	mutex_init(&em->video_lock);
+	retval = em8300_vb2_init(em);
+	if (retval) {
+		printk(KERN_ERR "em8300-video: unable to set up the buffer queue (error = %d).\n",
+			retval);
+		video_device_release(em->vdev);
+		return retval;
+	}
+	/* Not vdev->lock, see em8300_v4l2_ioctl */
+	em->vdev->queue = &em->vb_queue;
+
 	/* register the v4l2 device */
 	video_set_drvdata(em->vdev, em);
 	retval = video_register_device(em->vdev, VFL_TYPE_GRABBER, -1);
@@ -101,6 +189,211 @@ static int mpegvideo_command(struct em8300_s *em, int cmd)
 		return em8300_waitfor(em, ucregister(MV_Command), 0xffff, 0xffff);
 }
 
+static int em8300_video_ptsfifo_ready(struct em8300_s *em)
+{
+	return (read_register(ucregister(MV_PTSFifo) + 4 * em->video_ptsfifo_ptr + 3) & 1) == 0;
+}
+
+/*
+ * Fill the next PTS fifo entry, which must be free, with pts (in 45kHz
+ * units) for the data at offset in the stream.
+ */
+static void em8300_video_put_pts(struct em8300_s *em, uint32_t pts, int offset)
+{
+	int ptsfifoptr = ucregister(MV_PTSFifo) + 4 * em->video_ptsfifo_ptr;
+
+	write_register(ptsfifoptr, offset >> 16);
+	write_register(ptsfifoptr + 1, offset & 0xffff);
+	write_register(ptsfifoptr + 2, pts >> 16);
+	write_register(ptsfifoptr + 3, (pts & 0xffff) | 1);
+
+	em->video_ptsfifo_ptr++;
+	em->video_ptsfifo_ptr %= read_ucregister(MV_PTSSize) / 4;
+}
+
+/*
+ * The PTS fifo of the card only has a few entries, so the PTS are queued
+ * in video_ptsqueue first, along with the stream offset they apply to, and
+ * moved to the card as it frees entries. Only when video_ptsqueue is full
+ * does a writer have to wait.
+ */
+static int em8300_video_push_pts(struct em8300_s *em, uint32_t pts, int offset)
+{
+	struct em8300_pts_s entry = { pts, offset };
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&em->video_ptsqueue_lock, flags);
+	if (kfifo_is_empty(&em->video_ptsqueue) && em8300_video_ptsfifo_ready(em))
+		em8300_video_put_pts(em, pts, offset);
+	else if (!kfifo_put(&em->video_ptsqueue, &entry))
+		ret = -EAGAIN;
+	spin_unlock_irqrestore(&em->video_ptsqueue_lock, flags);
+
+	if (!ret && (!em->video_segment_valid || (int)(pts - em->video_segment_end) > 0)) {
+		em->video_segment_end = pts;
+		em->video_segment_valid = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Gapless playback: instead of stopping between clips, userspace declares
+ * where the next clip starts on the timeline, and the PTS and SCR it gives
+ * from then on, in the time base of the clip, are shifted by the
+ * difference. The decoder thus sees a single continuous stream, and keeps
+ * playing across the boundary.
+ */
+static uint32_t em8300_video_rebase(struct em8300_s *em, uint32_t pts)
+{
+	return pts + em->video_pts_delta;
+}
+
+/* Queue pts, in 90kHz ticks, for the data written next */
+int em8300_video_push_stream_pts(struct em8300_s *em, uint32_t pts)
+{
+	return em8300_video_push_pts(em, em8300_video_rebase(em, pts) >> 1, em->video_offset);
+}
+
+static int em8300_video_segment(struct em8300_s *em, const em8300_video_segment_t *segment)
+{
+	uint32_t position = segment->position;
+
+	if (segment->flags & EM8300_VIDEO_SEGMENT_FOLLOW) {
+		if (!em->video_segment_valid || !segment->duration)
+			return -EINVAL;
+		/*
+		 * One frame after the latest PTS queued so far. The frame rate
+		 * of the stream need not match the video mode, so the caller
+		 * gives the frame duration.
+		 */
+		position = (em->video_segment_end << 1) + segment->duration;
+	}
+
+	em->video_pts_delta = position - segment->pts;
+	/* The first PTS of the clip must be queued even if it repeats the last one */
+	em->video_lastpts = ~segment->pts;
+
+	return 0;
+}
+
+static int em8300_video_ptsqueue_ready(struct em8300_s *em)
+{
+	return !kfifo_is_full(&em->video_ptsqueue);
+}
+
+/* Called from the VBL interrupt */
+void em8300_video_check_ptsfifo(struct em8300_s *em)
+{
+	struct em8300_pts_s entry;
+
+	spin_lock(&em->video_ptsqueue_lock);
+	while (!kfifo_is_empty(&em->video_ptsqueue) && em8300_video_ptsfifo_ready(em)) {
+		if (!kfifo_get(&em->video_ptsqueue, &entry))
+			break;
+		em8300_video_put_pts(em, entry.pts, entry.offset);
+	}
+	spin_unlock(&em->video_ptsqueue_lock);
+
+	if (em8300_video_ptsqueue_ready(em))
+		wake_up_interruptible(&em->video_ptsfifo_wait);
+}
+
+/*
+ * Clients following the display (subtitle or overlay renderers) subscribe
+ * to EM8300_EVENT_VBL instead of polling the frame counter and the SCR.
+ * The registers are read once per VBL, and only while someone listens;
+ * each subscriber then dequeues the events from its own queue, whose
+ * oldest entries are dropped if it lags behind.
+ */
+#define EM8300_VBL_EVENT_DEPTH 32
+
+static int em8300_video_vbl_event_add(struct v4l2_subscribed_event *sev, unsigned elems)
+{
+	struct em8300_s *em = video_get_drvdata(sev->fh->vdev);
+
+	atomic_inc(&em->vbl_subscribers);
+	return 0;
+}
+
+static void em8300_video_vbl_event_del(struct v4l2_subscribed_event *sev)
+{
+	struct em8300_s *em = video_get_drvdata(sev->fh->vdev);
+
+	atomic_dec(&em->vbl_subscribers);
+}
+
+static const struct v4l2_subscribed_event_ops em8300_video_vbl_event_ops = {
+	.add = em8300_video_vbl_event_add,
+	.del = em8300_video_vbl_event_del,
+};
+
+int em8300_video_subscribe_event(struct v4l2_fh *fh, struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case EM8300_EVENT_VBL:
+		return v4l2_event_subscribe(fh, sub, EM8300_VBL_EVENT_DEPTH,
+					    &em8300_video_vbl_event_ops);
+	case V4L2_EVENT_EOS:
+		return v4l2_event_subscribe(fh, sub, 2, NULL);
+	}
+	return -EINVAL;
+}
+
+/* Called from the VBL interrupt */
+void em8300_video_queue_vbl_event(struct em8300_s *em)
+{
+	struct v4l2_event ev;
+	em8300_vbl_event_t *vbl = (em8300_vbl_event_t *)ev.u.data;
+
+	if (!atomic_read(&em->vbl_subscribers))
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = EM8300_EVENT_VBL;
+	vbl->timestamp = ktime_to_ns(em->vbl_time);
+	vbl->framecount = read_ucregister(MV_FrameCntLo) | (read_ucregister(MV_FrameCntHi) << 16);
+	vbl->scr = read_ucregister(MV_SCRlo) | (read_ucregister(MV_SCRhi) << 16);
+	vbl->vblcount = em->irqcount;
+
+	v4l2_event_queue(em->vdev, &ev);
+}
+
+static void em8300_video_reset_pts(struct em8300_s *em)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&em->video_ptsqueue_lock, flags);
+	kfifo_reset(&em->video_ptsqueue);
+	em->video_ptsfifo_ptr = 0;
+	spin_unlock_irqrestore(&em->video_ptsqueue_lock, flags);
+}
+
+/* Nominal SCR speed, and the one used in EM8300_PLAYMODE_SLOWFORWARDS */
+#define EM8300_VIDEO_SPEED 0x900
+#define EM8300_VIDEO_SLOW_SPEED (EM8300_VIDEO_SPEED / 2)
+
+/*
+ * The decoder stops by itself once its frame counter reaches the value in
+ * MV_FrameEvent; 0x7fffffff is never reached.
+ */
+static void em8300_video_set_frameevent(struct em8300_s *em, unsigned frame)
+{
+	write_ucregister(MV_FrameEventLo, frame & 0xffff);
+	write_ucregister(MV_FrameEventHi, (frame >> 16) & 0x7fff);
+}
+
+/* Show the next frame, then stop again */
+static int em8300_video_singlestep(struct em8300_s *em)
+{
+	unsigned framecnt;
+
+	framecnt = read_ucregister(MV_FrameCntLo) | (read_ucregister(MV_FrameCntHi) << 16);
+	em8300_video_set_frameevent(em, framecnt + 1);
+	return mpegvideo_command(em, MVCOMMAND_START);
+}
+
 int em8300_video_setplaymode(struct em8300_s *em, int mode)
 {
 	if (mode == EM8300_PLAYMODE_FRAMEBUF) {
@@ -109,11 +402,29 @@ int em8300_video_setplaymode(struct em8300_s *em, int mode)
 		return 0;
 	}
 
+	/* Each request for single step mode shows one more frame */
+	if (mode == EM8300_PLAYMODE_SINGLESTEP &&
+	    em->video_playmode == EM8300_PLAYMODE_SINGLESTEP)
+		return em8300_video_singlestep(em) ? -1 : 0;
+
 	if (em->video_playmode != mode) {
+		/* Undo what the trick modes changed */
+		switch (em->video_playmode) {
+		case EM8300_PLAYMODE_SLOWFORWARDS:
+			em8300_video_setspeed(em, EM8300_VIDEO_SPEED);
+			em8300_avsync_speed_changed(em);
+			break;
+		case EM8300_PLAYMODE_SINGLESTEP:
+			em8300_video_set_frameevent(em, 0x7fffffff);
+			break;
+		}
+
 		switch (mode) {
 		case EM8300_PLAYMODE_STOPPED:
-			em->video_ptsfifo_ptr = 0;
+			em8300_video_reset_pts(em);
 			em->video_offset = 0;
+			em->video_pts_delta = 0;
+			em->video_segment_valid = 0;
 			mpegvideo_command(em, MVCOMMAND_STOP);
 			mpegvideo_command(em, MVCOMMAND_DISPLAYBUFINFO);
 			em8300_dicom_fill_dispbuffers(em, 0, 0, em->dbuf_info.xsize, em->dbuf_info.ysize, 0x00000000, 0x80808080);
@@ -130,7 +441,22 @@ int em8300_video_setplaymode(struct em8300_s *em, int mode)
 		case EM8300_PLAYMODE_PAUSED:
 			mpegvideo_command(em, MVCOMMAND_PAUSE);
 			break;
+		case EM8300_PLAYMODE_SLOWFORWARDS:
+			em8300_video_setspeed(em, EM8300_VIDEO_SLOW_SPEED);
+			em8300_avsync_speed_changed(em);
+			mpegvideo_command(em, MVCOMMAND_START);
+			break;
+		case EM8300_PLAYMODE_SINGLESTEP:
+			em8300_video_singlestep(em);
+			break;
+		case EM8300_PLAYMODE_SCAN:
+			/* Drop everything up to the next sequence, GOP or I picture */
+			em->video_scan_drop = 1;
+			em->video_scan_carried = 0;
+			mpegvideo_command(em, MVCOMMAND_PLAYINTRA);
+			break;
 		default:
+			/* The decoder cannot play backwards */
 			return -1;
 		}
 
@@ -142,70 +468,275 @@ int em8300_video_setplaymode(struct em8300_s *em, int mode)
 	return -1;
 }
 
-int em8300_video_sync(struct em8300_s *em)
-{
-	int rdptr, wrptr, rdptr_last, synctimeout;
+/*
+ * The decoder has used up all it was given once the fifo is empty and
+ * MV_RdPtr has reached MV_Wrptr. While a drain is in progress, this is
+ * checked from the fifo and VBL interrupts, and waiters are woken and an
+ * EOS event is sent as soon as it happens. A read pointer that does not
+ * move for EM8300_DRAIN_IDLE checks ends the drain too, as the data left
+ * will never be decoded.
+ */
+#define EM8300_DRAIN_IDLE 25
 
-	rdptr_last = 0;
-	synctimeout = 0;
+/* Called from the fifo and VBL interrupts */
+void em8300_video_drain_check(struct em8300_s *em)
+{
+	struct v4l2_event ev;
+	unsigned rdptr, wrptr;
 
-	do {
-		wrptr = read_ucregister(MV_Wrptr_Lo) |
-			(read_ucregister(MV_Wrptr_Hi) << 16);
-		rdptr = read_ucregister(MV_RdPtr_Lo) |
-			(read_ucregister(MV_RdPtr_Hi) << 16);
+	if (em->video_drain != EM8300_DRAIN_ACTIVE || !em8300_fifo_empty(em->mvfifo))
+		return;
 
-		if (rdptr == wrptr)
-			break;
+	wrptr = read_ucregister(MV_Wrptr_Lo) | (read_ucregister(MV_Wrptr_Hi) << 16);
+	rdptr = read_ucregister(MV_RdPtr_Lo) | (read_ucregister(MV_RdPtr_Hi) << 16);
 
-		if (rdptr == rdptr_last) {
-			pr_debug("em8300-%d: Video sync rdptr is stuck at 0x%08x, wrptr 0x%08x, left %d\n", em->instance, rdptr, wrptr, wrptr - rdptr);
-			break;
+	if (rdptr != wrptr) {
+		if (rdptr != em->video_drain_rdptr) {
+			em->video_drain_rdptr = rdptr;
+			em->video_drain_idle = 0;
+			return;
 		}
-		rdptr_last = rdptr;
+		if (++em->video_drain_idle < EM8300_DRAIN_IDLE)
+			return;
+		pr_debug("em8300-%d: Video sync rdptr is stuck at 0x%08x, wrptr 0x%08x, left %d\n", em->instance, rdptr, wrptr, wrptr - rdptr);
+	}
 
-		set_current_state(TASK_INTERRUPTIBLE);
-		schedule_timeout(HZ / 2);
+	em->video_drain = EM8300_DRAIN_DONE;
+	wake_up_interruptible(&em->video_drain_wait);
 
-		if (signal_pending(current)) {
-			set_current_state(TASK_RUNNING);
-			printk(KERN_ERR "em8300-%d: Video sync interrupted\n", em->instance);
-			return -EINTR;
-		}
-	} while (++synctimeout < 4);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = V4L2_EVENT_EOS;
+	v4l2_event_queue(em->vdev, &ev);
+}
 
-	if (rdptr != wrptr)
+/* Start a drain, unless one is already in progress */
+static void em8300_video_drain_start(struct em8300_s *em)
+{
+	if (em->video_drain == EM8300_DRAIN_ACTIVE)
+		return;
+
+	em->video_drain_rdptr = 0xffffffff;
+	em->video_drain_idle = 0;
+	smp_wmb();
+	em->video_drain = EM8300_DRAIN_ACTIVE;
+
+	if (em->mvfifo->staging_buffer)
+		schedule_work(&em->mvfifo->refill_work);
+}
+
+int em8300_video_sync(struct em8300_s *em)
+{
+	long ret;
+
+	em8300_video_drain_start(em);
+
+	ret = wait_event_interruptible_timeout(em->video_drain_wait,
+					       em->video_drain != EM8300_DRAIN_ACTIVE, 2 * HZ);
+	if (ret < 0) {
+		printk(KERN_ERR "em8300-%d: Video sync interrupted\n", em->instance);
+		return -EINTR;
+	}
+	if (ret == 0)
 		pr_debug("em8300-%d: Video sync timeout\n", em->instance);
 
-	set_current_state(TASK_RUNNING);
+	em->video_drain = EM8300_DRAIN_NONE;
 
 	return 0;
 }
 
-int em8300_video_flush(struct em8300_s *em)
+/*
+ * Non-blocking drain: returns 1 once a drain started by an earlier call has
+ * completed, and 0 while it is in progress; otherwise starts a new one and
+ * returns 0. Completion is also signalled by an EOS event.
+ */
+static int em8300_video_drain(struct em8300_s *em)
+{
+	switch (em->video_drain) {
+	case EM8300_DRAIN_ACTIVE:
+		return 0;
+	case EM8300_DRAIN_DONE:
+		em->video_drain = EM8300_DRAIN_NONE;
+		return 1;
+	}
+
+	em8300_video_drain_start(em);
+	return 0;
+}
+
+/*
+ * Stall detection for writers blocked on a full fifo. The decoder is
+ * making progress as long as it reads the bitstream (MV_RdPtr) or decodes
+ * frames (MV_FrameCnt), and the fifo as long as slots are reclaimed from
+ * it (its PCI read pointer). Only when the progress that counts did not
+ * happen between two checks is the decoder considered stuck, and it is
+ * recovered with increasingly disruptive steps.
+ */
+#define EM8300_STALL_DECODED 1
+#define EM8300_STALL_RECLAIMED 2
+
+/* Checks without a slot reclaimed before a fifo counts as stuck */
+#define EM8300_STALL_IDLE 4
+
+static int em8300_video_stall_sample(struct em8300_s *em, struct em8300_stall_s *stall)
+{
+	unsigned rdptr, framecnt;
+	int readptr, progress = 0;
+
+	rdptr = read_ucregister(MV_RdPtr_Lo) | (read_ucregister(MV_RdPtr_Hi) << 16);
+	framecnt = read_ucregister(MV_FrameCntLo) | (read_ucregister(MV_FrameCntHi) << 16);
+	readptr = stall->fifo->ops->get_readptr(stall->fifo);
+
+	if (rdptr != stall->rdptr || framecnt != stall->framecnt)
+		progress |= EM8300_STALL_DECODED;
+	if (readptr != stall->readptr)
+		progress |= EM8300_STALL_RECLAIMED;
+
+	stall->rdptr = rdptr;
+	stall->framecnt = framecnt;
+	stall->readptr = readptr;
+
+	return progress;
+}
+
+void em8300_video_stall_start(struct em8300_s *em, struct em8300_stall_s *stall, struct fifo_s *fifo)
+{
+	stall->fifo = fifo;
+	em8300_video_stall_sample(em, stall);
+	stall->stage = EM8300_STALL_NONE;
+	stall->idle = 0;
+}
+
+/*
+ * Called periodically while the fifo of stall stays full. Returns the
+ * recovery step taken, EM8300_STALL_NONE if the decoder is paused or still
+ * making progress, or -1 once all the steps failed.
+ *
+ * In normal play, the video fifo is stuck once the decoder stops. In the
+ * trick modes the decoder repeats or skips pictures, and the sub-picture
+ * fifo can stop while video goes on, so there only reclaimed slots count.
+ * As those may come at a lower rate, such a fifo is given EM8300_STALL_IDLE
+ * checks before recovery starts.
+ */
+int em8300_video_stall_check(struct em8300_s *em, struct em8300_stall_s *stall)
+{
+	int mode = em->video_playmode;
+	int progress, stuck;
+
+	progress = em8300_video_stall_sample(em, stall);
+	if (progress & EM8300_STALL_RECLAIMED)
+		stall->idle = 0;
+	else
+		stall->idle++;
+
+	if ((mode != EM8300_PLAYMODE_PLAY &&
+	     mode != EM8300_PLAYMODE_SLOWFORWARDS &&
+	     mode != EM8300_PLAYMODE_SCAN) ||
+	    read_ucregister(MV_SCRSpeed) == 0) {
+		stall->idle = 0;
+		stuck = 0;
+	} else if (mode == EM8300_PLAYMODE_PLAY && stall->fifo == em->mvfifo)
+		stuck = !progress;
+	else
+		stuck = stall->idle >= EM8300_STALL_IDLE;
+
+	if (!stuck) {
+		stall->stage = EM8300_STALL_NONE;
+		return EM8300_STALL_NONE;
+	}
+
+	switch (++stall->stage) {
+	case EM8300_STALL_SYNC:
+		printk(KERN_WARNING "em8300-%d: Video decoder stalled, trying sync\n", em->instance);
+		em->stall_syncs++;
+		mpegvideo_command(em, MVCOMMAND_SYNC);
+		break;
+	case EM8300_STALL_FLUSH:
+		printk(KERN_WARNING "em8300-%d: Video decoder still stalled, flushing its buffer\n", em->instance);
+		em->stall_flushes++;
+		mpegvideo_command(em, MVCOMMAND_FLUSHBUF);
+		break;
+	case EM8300_STALL_RESTART:
+		printk(KERN_WARNING "em8300-%d: Video decoder still stalled, restarting it\n", em->instance);
+		em->stall_restarts++;
+		em8300_video_setplaymode(em, EM8300_PLAYMODE_STOPPED);
+		em8300_video_setplaymode(em, mode);
+		break;
+	default:
+		em->stall_failures++;
+		stall->stage = EM8300_STALL_NONE;
+		return -1;
+	}
+
+	/* The recovery step itself must not count as progress */
+	em8300_video_stall_sample(em, stall);
+
+	return stall->stage;
+}
+
+/* Forget the video data and PTS the decoder has not used yet */
+static void em8300_video_drop(struct em8300_s *em)
 {
 	write_ucregister(MV_Wrptr_Lo, 0);
 	write_ucregister(MV_Wrptr_Hi, 0);
 	write_ucregister(MV_RdPtr_Lo, 0);
 	write_ucregister(MV_RdPtr_Hi, 0);
-	writel(readl(em->mvfifo->readptr), em->mvfifo->writeptr);
 
 	em->video_ptsvalid = 0;
 	em->video_pts = 0;
-	em->video_ptsfifo_ptr = 0;
+	em8300_video_reset_pts(em);
 	em->video_offset = 0;
+}
 
-	write_ucregister(SP_Wrptr_Lo, 0);
-	write_ucregister(SP_Wrptr_Hi, 0);
-	write_ucregister(SP_RdPtr_Lo, 0);
-	write_ucregister(SP_RdPtr_Hi, 0);
-	writel(readl(em->spfifo->readptr), em->spfifo->writeptr);
+int em8300_video_flush(struct em8300_s *em)
+{
+	if (em->vb_streaming)
+		return -EBUSY;
 
-	em->sp_ptsfifo_ptr = 0;
-	em->sp_ptsvalid = 0;
-	em->sp_pts = 0;
+	em8300_video_drop(em);
+	em8300_fifo_flush(em->mvfifo);
 
-	return 0;
+	return em8300_spu_flush(em);
+}
+
+/*
+ * Seek support: drop everything queued for the video and sub-picture
+ * decoders at once, with both fifos locked so that no writer slips data
+ * in between, and have the decoder flush its buffer. Unlike a stop or a
+ * sync, nothing waits for the decoder, so it goes on with the data written
+ * next within a field. Returns the time it took, in us.
+ */
+int em8300_video_discontinuity(struct em8300_s *em)
+{
+	ktime_t start = ktime_get();
+
+	if (!em->mvfifo->valid || !em->spfifo->valid)
+		return -ENODEV;
+	if (em->vb_streaming)
+		return -EBUSY;
+
+	mutex_lock(&em->mvfifo->lock);
+	mutex_lock(&em->spfifo->lock);
+
+	em8300_video_drop(em);
+	em8300_fifo_flush_nolock(em->mvfifo);
+	em8300_spu_drop(em);
+	em8300_fifo_flush_nolock(em->spfifo);
+
+	if (em->video_playmode == EM8300_PLAYMODE_SCAN)
+		em->video_scan_drop = 1;
+	em->video_scan_carried = 0;
+
+	/* mpegvideo_command would wait for the display to be updated */
+	if (!em8300_waitfor(em, ucregister(MV_Command), 0xffff, 0xffff))
+		write_ucregister(MV_Command, MVCOMMAND_FLUSHBUF);
+
+	mutex_unlock(&em->spfifo->lock);
+	mutex_unlock(&em->mvfifo->lock);
+
+	wake_up_interruptible(&em->mvfifo->wait);
+	wake_up_interruptible(&em->spfifo->wait);
+
+	return ktime_us_delta(ktime_get(), start);
 }
 
 int em8300_video_setup(struct em8300_s *em)
@@ -288,7 +819,8 @@ int em8300_video_setup(struct em8300_s *em)
 		return -ETIME;
 	}
 
-	em8300_video_setspeed(em, 0x900);
+	em8300_video_setspeed(em, EM8300_VIDEO_SPEED);
+	em8300_avsync_speed_changed(em);
 
 	write_ucregister(MV_FrameEventLo, 0xffff);
 	write_ucregister(MV_FrameEventHi, 0x7fff);
@@ -318,31 +850,32 @@ void em8300_video_setspeed(struct em8300_s *em, int speed)
 	}
 }
 
-void em8300_video_check_ptsfifo(struct em8300_s *em)
-{
-	int ptsfifoptr;
-
-	ptsfifoptr = ucregister(MV_PTSFifo) + 4 * em->video_ptsfifo_ptr;
-
-	if (!(read_register(ptsfifoptr + 3) & 1))
-		wake_up_interruptible(&em->video_ptsfifo_wait);
-}
-
-ssize_t em8300_video_write(struct em8300_s *em, const char *buf, size_t count, loff_t *ppos)
+/*
+ * Queue the pending PTS, if any, for the data at the current stream offset,
+ * and set the slot flags the data must be written with.
+ */
+static int em8300_video_queue_pts(struct em8300_s *em, unsigned *flags, int nonblock)
 {
-	unsigned flags = 0;
-	int written;
+	uint32_t pts;
 	long ret;
 
-	if (em->video_ptsvalid) {
-		int ptsfifoptr = 0;
-		em->video_pts >>= 1;
+	*flags = 0;
 
-		flags = 0x40000000;
-		ptsfifoptr = ucregister(MV_PTSFifo) + 4 * em->video_ptsfifo_ptr;
-
-		ret = wait_event_interruptible_timeout(em->video_ptsfifo_wait,
-						       (read_register(ptsfifoptr + 3) & 1) == 0, HZ);
+	if (em->video_ptsvalid) {
+		/* em->video_pts stays as given, the write may be retried */
+		pts = em8300_video_rebase(em, em->video_pts) >> 1;
+
+		*flags = 0x40000000;
+
+		if (nonblock) {
+			if (em8300_video_push_pts(em, pts, em->video_offset))
+				return -EAGAIN;
+			ret = 1;
+		} else {
+			ret = wait_event_interruptible_timeout(em->video_ptsfifo_wait,
+							       !em8300_video_push_pts(em, pts, em->video_offset),
+							       HZ);
+		}
 		if (ret == 0) {
 			printk(KERN_ERR "em8300-%d: Video Fifo timeout\n", em->instance);
 			return -EINTR;
@@ -350,24 +883,196 @@ ssize_t em8300_video_write(struct em8300_s *em, const char *buf, size_t count, l
 			return ret;
 
 #ifdef DEBUG_SYNC
-		pr_info("em8300-%d: pts: %u\n", em->instance, em->video_pts >> 1);
+		pr_info("em8300-%d: pts: %u\n", em->instance, pts >> 1);
 #endif
 
-		write_register(ptsfifoptr, em->video_offset >> 16);
-		write_register(ptsfifoptr + 1, em->video_offset & 0xffff);
-		write_register(ptsfifoptr + 2, em->video_pts >> 16);
-		write_register(ptsfifoptr + 3, (em->video_pts & 0xffff) | 1);
-
-		em->video_ptsfifo_ptr++;
-		em->video_ptsfifo_ptr %= read_ucregister(MV_PTSSize) / 4;
-
 		em->video_ptsvalid = 0;
 	}
 
-	if (em->nonblock[2])
-		written = em8300_fifo_write(em->mvfifo, count, buf, flags);
+	return 0;
+}
+
+static int em8300_video_write_fifo(struct em8300_s *em, const char *buf, int count, unsigned flags,
+				   int nonblock)
+{
+	if (nonblock)
+		return em8300_fifo_write(em->mvfifo, count, buf, flags);
 	else
-		written = em8300_fifo_writeblocking(em->mvfifo, count, buf, flags);
+		return em8300_fifo_writeblocking(em->mvfifo, count, buf, flags);
+}
+
+/*
+ * In scan mode the decoder only shows intra pictures, so the others are not
+ * sent over the bus at all: the stream is cut at picture start codes, and
+ * pictures whose coding type is not I are dropped up to the next start code
+ * of a picture, a GOP or a sequence. Other start codes (slices, extensions,
+ * user data) belong to the picture they follow.
+ *
+ * Data is only consumed up to the last start code the write could not
+ * decide about, so that userspace writes it again along with what follows.
+ * When that start code is all that is left, it is consumed and kept in
+ * em->video_scan_carry instead, and parsed again ahead of the next write.
+ * Stream positions below 0 are in these carried bytes.
+ */
+#define EM8300_VIDEO_SCAN_CHUNK 256
+
+/*
+ * Write the stream from *from to to. *from is left where the write stopped.
+ * Returns 0, or the error of a write that fell short.
+ */
+static int em8300_video_scan_write(struct em8300_s *em, const char *buf, long *from, long to,
+				   unsigned *flags, int nonblock)
+{
+	mm_segment_t old_fs;
+	int n, ret;
+
+	if (*from < 0) {
+		n = min(to, 0L) - *from;
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = em8300_video_write_fifo(em, (const char *) em->video_scan_carry +
+					      em->video_scan_carried + *from, n, *flags, nonblock);
+		set_fs(old_fs);
+		if (ret > 0) {
+			em->video_offset += ret;
+			*from += ret;
+			*flags = 0;
+		}
+		if (ret < n)
+			return min(ret, 0);
+	}
+
+	if (*from < to) {
+		n = to - *from;
+		ret = em8300_video_write_fifo(em, buf + *from, n, *flags, nonblock);
+		if (ret > 0) {
+			em->video_offset += ret;
+			*from += ret;
+			*flags = 0;
+		}
+		if (ret < n)
+			return min(ret, 0);
+	}
+
+	return 0;
+}
+
+/* Keep the carried bytes from done on, returns the bytes of buf consumed */
+static ssize_t em8300_video_scan_consume(struct em8300_s *em, long done)
+{
+	if (done < 0) {
+		memmove(em->video_scan_carry, em->video_scan_carry + em->video_scan_carried + done, -done);
+		em->video_scan_carried = -done;
+		return 0;
+	}
+	em->video_scan_carried = 0;
+	return done;
+}
+
+static ssize_t em8300_video_write_intra(struct em8300_s *em, const char *buf, size_t count,
+					unsigned flags, int nonblock)
+{
+	unsigned char chunk[EM8300_VIDEO_SCAN_CHUNK], carry[sizeof(em->video_scan_carry)];
+	long pos, start, code = 0, cut, reached;
+	int zeros = 0, header = 0, drop, n, i, ret;
+	ssize_t done;
+	unsigned char c;
+
+	start = -em->video_scan_carried;
+	for (pos = start; pos < (long) count; pos += n) {
+		if (pos < 0) {
+			n = -pos;
+			memcpy(chunk, em->video_scan_carry, n);
+		} else {
+			n = min_t(long, count - pos, sizeof(chunk));
+			if (copy_from_user(chunk, buf + pos, n))
+				return pos > 0 ? em8300_video_scan_consume(em, start) : -EFAULT;
+		}
+
+		for (i = 0; i < n; i++) {
+			c = chunk[i];
+			drop = -1;
+
+			switch (header) {
+			case 0:
+				break;
+			case 1:		/* start code value */
+				header = 0;
+				if (c == 0x00)
+					header = 2;
+				else if (c == 0xb3 || c == 0xb7 || c == 0xb8)
+					drop = 0;
+				break;
+			case 2:		/* temporal reference */
+				header = 3;
+				break;
+			case 3:		/* picture coding type */
+				header = 0;
+				drop = ((c >> 3) & 7) != 1;
+				break;
+			}
+
+			if (drop >= 0 && drop != em->video_scan_drop) {
+				if (!em->video_scan_drop && code > start) {
+					reached = start;
+					ret = em8300_video_scan_write(em, buf, &reached, code, &flags, nonblock);
+					if (reached != code) {
+						done = em8300_video_scan_consume(em, reached);
+						return done ? done : ret;
+					}
+				}
+				start = code;
+				em->video_scan_drop = drop;
+			}
+
+			if (c == 1 && zeros >= 2) {
+				header = 1;
+				code = pos + i - 2;
+			}
+			zeros = c ? 0 : min(zeros + 1, 2);
+		}
+	}
+
+	/* Leave an undecided start code, or what may begin one, for the next write */
+	cut = header ? code : (long) count - zeros;
+	if (cut <= start) {
+		/* Nothing else is left: carry it over, userspace may not have more */
+		n = (long) count - max(start, 0L);
+		if (copy_from_user(carry, buf + max(start, 0L), n))
+			return -EFAULT;
+		if (start < 0)
+			memmove(em->video_scan_carry, em->video_scan_carry + em->video_scan_carried + start, -start);
+		memcpy(em->video_scan_carry + max(-start, 0L), carry, n);
+		em->video_scan_carried = (long) count - start;
+		return count;
+	}
+
+	if (!em->video_scan_drop) {
+		reached = start;
+		ret = em8300_video_scan_write(em, buf, &reached, cut, &flags, nonblock);
+		if (reached != cut) {
+			done = em8300_video_scan_consume(em, reached);
+			return done ? done : ret;
+		}
+	}
+
+	return em8300_video_scan_consume(em, cut);
+}
+
+ssize_t em8300_video_write(struct em8300_s *em, const char *buf, size_t count, loff_t *ppos,
+			   int nonblock)
+{
+	unsigned flags;
+	int written;
+
+	written = em8300_video_queue_pts(em, &flags, nonblock);
+	if (written)
+		return written;
+
+	if (em->video_playmode == EM8300_PLAYMODE_SCAN)
+		return em8300_video_write_intra(em, buf, count, flags, nonblock);
+
+	written = em8300_video_write_fifo(em, buf, count, flags, nonblock);
 
 	if (written > 0)
 		em->video_offset += written;
@@ -375,11 +1080,146 @@ ssize_t em8300_video_write(struct em8300_s *em, const char *buf, size_t count, l
 	return written;
 }
 
-int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg)
+/*
+ * Write a batch of packets, each with an optional PTS. The packets are
+ * written in runs that start with a packet carrying a new PTS, and that PTS
+ * is queued right before its run is written, so PTS entries never get ahead
+ * of the data by more than one packet. A PTS is only queued once, so a
+ * partially written packet can be sent again as is.
+ */
+static int em8300_video_writev(struct em8300_s *em, em8300_video_writev_t *wv, int nonblock)
+{
+	em8300_video_packet_t *packets;
+	struct fifo_iovec_s *iov;
+	int done = 0, written = 0, pushed, k, ret = 0;
+	unsigned long total = 0;
+	long timeout;
+
+	if (wv->count > EM8300_VIDEO_WRITEV_MAX)
+		return -EINVAL;
+
+	packets = kmalloc(wv->count * sizeof(em8300_video_packet_t), GFP_KERNEL);
+	iov = kmalloc(wv->count * sizeof(struct fifo_iovec_s), GFP_KERNEL);
+	if (packets == NULL || iov == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(packets, wv->packets, wv->count * sizeof(em8300_video_packet_t))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* The fifo takes int sizes and the result is returned as an int */
+	for (k = 0; k < wv->count; k++) {
+		total += packets[k].size;
+		if ((int)packets[k].size < 0 || total > INT_MAX) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	while (done < wv->count) {
+		pushed = 0;
+		if ((packets[done].flags & EM8300_VIDEO_PACKET_PTS) &&
+		    packets[done].pts != em->video_lastpts) {
+			if (em8300_video_push_pts(em, em8300_video_rebase(em, packets[done].pts) >> 1,
+						  em->video_offset)) {
+				/* The PTS queue is full */
+				if (nonblock) {
+					ret = -EAGAIN;
+					break;
+				}
+				timeout = wait_event_interruptible_timeout(em->video_ptsfifo_wait,
+									   em8300_video_ptsqueue_ready(em), HZ);
+				if (timeout == 0) {
+					printk(KERN_ERR "em8300-%d: Video Fifo timeout\n", em->instance);
+					ret = -EINTR;
+					break;
+				} else if (timeout < 0) {
+					ret = timeout;
+					break;
+				}
+				continue;
+			}
+			em->video_lastpts = packets[done].pts;
+			pushed = 1;
+		}
+
+		for (k = done; k < wv->count; k++) {
+			if (k > done && (packets[k].flags & EM8300_VIDEO_PACKET_PTS) &&
+			    packets[k].pts != em->video_lastpts)
+				break;
+			iov[k].data = packets[k].data;
+			iov[k].size = packets[k].size;
+			iov[k].flags = 0;
+		}
+		if (pushed)
+			iov[done].flags = 0x40000000;
+
+		ret = em8300_fifo_writev(em->mvfifo, iov + done, k - done, nonblock);
+		if (ret < 0)
+			break;
+		em->video_offset += ret;
+		written += ret;
+
+		while (done < k && ret >= iov[done].size)
+			ret -= iov[done++].size;
+		if (done < k)
+			break;
+		ret = 0;
+	}
+
+	wv->count = done;
+	wv->written = written;
+
+out:
+	kfree(iov);
+	kfree(packets);
+	return written ? 0 : ret;
+}
+
+/*
+ * Queue data userspace wrote to the mapped video fifo, and tell it where to
+ * write next.
+ */
+static int em8300_video_commit(struct em8300_s *em, em8300_video_commit_t *commit, int nonblock)
+{
+	unsigned flags;
+	int written = 0;
+
+	if (commit->length) {
+		if (commit->flags & EM8300_VIDEO_COMMIT_PTS && commit->pts != em->video_lastpts) {
+			em->video_pts = commit->pts;
+			em->video_ptsvalid = 1;
+			em->video_lastpts = em->video_pts;
+		}
+
+		written = em8300_video_queue_pts(em, &flags, nonblock);
+		if (written)
+			return written;
+
+		written = em8300_fifo_commit_mapped(em->mvfifo, commit->length, flags, nonblock);
+		if (written < 0)
+			return written;
+		em->video_offset += written;
+	}
+
+	commit->length = written;
+	em8300_fifo_mapped_position(em->mvfifo, &commit->head, &commit->tail, &commit->size);
+
+	return 0;
+}
+
+int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg, int nonblock)
 {
+	em8300_video_commit_t commit;
+	em8300_video_writev_t wv;
+	em8300_video_segment_t segment;
 	unsigned scr, val;
-	switch (_IOC_NR(cmd)) {
-	case _IOC_NR(EM8300_IOCTL_VIDEO_SETPTS):
+	int ret;
+
+	switch (cmd) {
+	case EM8300_IOCTL_VIDEO_SETPTS:
 		if (get_user(em->video_pts, (int *) arg))
 			return -EFAULT;
 
@@ -392,11 +1232,12 @@ int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg)
 		}
 		break;
 
-	case _IOC_NR(EM8300_IOCTL_VIDEO_SETSCR):
+	case EM8300_IOCTL_VIDEO_GETSCR:
+	case EM8300_IOCTL_VIDEO_SETSCR:
 		if (_IOC_DIR(cmd) & _IOC_WRITE) {
 			if (get_user(val, (unsigned *) arg))
 				return -EFAULT;
-			val >>= 1;
+			val = em8300_video_rebase(em, val) >> 1;
 			scr = read_ucregister(MV_SCRlo) | (read_ucregister(MV_SCRhi) << 16);
 			scr -= val;
 			if (scr < 0)
@@ -415,8 +1256,38 @@ int em8300_video_ioctl(struct em8300_s *em, unsigned int cmd, unsigned long arg)
 		}
 		break;
 
+	case EM8300_IOCTL_VIDEO_COMMIT:
+		if (copy_from_user(&commit, (void *) arg, sizeof(commit)))
+			return -EFAULT;
+		ret = em8300_video_commit(em, &commit, nonblock);
+		if (ret)
+			return ret;
+		if (copy_to_user((void *) arg, &commit, sizeof(commit)))
+			return -EFAULT;
+		break;
+
+	case EM8300_IOCTL_VIDEO_WRITEV:
+		if (copy_from_user(&wv, (void *) arg, sizeof(wv)))
+			return -EFAULT;
+		ret = em8300_video_writev(em, &wv, nonblock);
+		if (ret)
+			return ret;
+		if (copy_to_user((void *) arg, &wv, sizeof(wv)))
+			return -EFAULT;
+		break;
+
+	case EM8300_IOCTL_VIDEO_SEGMENT:
+		if (copy_from_user(&segment, (void *) arg, sizeof(segment)))
+			return -EFAULT;
+		return em8300_video_segment(em, &segment);
+
+	case EM8300_IOCTL_VIDEO_DRAIN:
+		if (put_user(em8300_video_drain(em), (int *) arg))
+			return -EFAULT;
+		break;
+
 	default:
-		return -EINVAL;
+		return -ENOIOCTLCMD;
 	}
 
 	return 0;
@@ -430,7 +1301,7 @@ void em8300_video_open(struct em8300_s *em)
 
 int em8300_video_release(struct em8300_s *em)
 {
-	em->video_ptsfifo_ptr = 0;
+	em8300_video_reset_pts(em);
 	em->video_offset = 0;
 	em->video_ptsvalid = 0;
 	em8300_fifo_sync(em->mvfifo);